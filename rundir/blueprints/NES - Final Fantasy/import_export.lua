@@ -1,20 +1,42 @@
 
 preImport = function()
-    srcfile = io.open("srcfile","rb", true)
+    -- If a patch was given, import from the patched ROM
+    srcfile = io.open("srcpatch","rb") or io.open("srcfile","rb", true)
     
     return srcfile
 end
 
 
-preExport = function()
+preExport = function(partial)
+    -- On a partial export, only the sections that changed get exported, so the existing
+    --   destination has to be updated in place instead of being rebuilt from the source
+    if partial then
+        dstfile = io.open("dstfile","r+b")
+        if dstfile then
+            return dstfile
+        end
+    end
+
     srcfile = io.open("srcfile","rb", true)
     dstfile = io.open("dstfile","w+b", true)
     
-    dstfile:write( srcfile:read("a") )
+    dstfile:copyfrom( srcfile )     -- shares the source image (no copy) until something is written
+    srcfile:close()
     
     return dstfile
 end
 
 postImExport = function(file)
     file:close()
+end
+
+
+postExport = function(file)
+    -- If a destination patch was given, it gets a patch of the exported ROM against the source
+    local patch = io.open("dstpatch","w+b")
+    if patch then
+        patch:copyfrom( file )
+        patch:close()
+    end
+    file:close()
 end
\ No newline at end of file
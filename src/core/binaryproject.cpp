@@ -0,0 +1,436 @@
+
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <QtGlobal>
+#include <QFile>
+#include "binaryproject.h"
+#include "error.h"
+
+#if Q_BYTE_ORDER != Q_LITTLE_ENDIAN
+#error "The binary project format copies numbers straight in and out of the file, which assumes a little endian machine"
+#endif
+
+namespace lsh
+{
+    namespace
+    {
+        const char              fileSignature[8] = { 'L', 'S', 'H', 'P', 'R', 'J', '\r', '\n' };
+        const std::uint32_t     fileVersion = 1;
+
+        //  Value types, as stored in the file.  (deliberately not ProjectData::Type, so that can change freely)
+        enum : std::uint8_t
+        {
+            tBool = 1,
+            tInt  = 2,
+            tDbl  = 3,
+            tStr  = 4,
+            tObj  = 5
+        };
+
+        void putLE(std::string& out, std::uint64_t v, int bytes)
+        {
+            for(int i = 0; i < bytes; ++i)
+                out.push_back( static_cast<char>( (v >> (i*8)) & 0xFF ) );
+        }
+
+        std::uint64_t getLE(const uchar* p, int bytes)
+        {
+            std::uint64_t v = 0;
+            for(int i = bytes-1; i >= 0; --i)
+                v = (v << 8) | p[i];
+            return v;
+        }
+
+        //  Numbers in the key list are mostly tiny, so they're stored 7 bits at a time
+        void putVarint(std::string& out, std::uint64_t v)
+        {
+            while(v >= 0x80)
+            {
+                out.push_back( static_cast<char>( (v & 0x7F) | 0x80 ) );
+                v >>= 7;
+            }
+            out.push_back( static_cast<char>(v) );
+        }
+
+        //////////////////////////////////////////////////////////////////
+        //  Writing
+
+        class Output
+        {
+        public:
+            explicit Output(QIODevice& dev) : device(dev) {}
+
+            void raw(const void* data, std::size_t size)
+            {
+                if(!size)
+                    return;
+                if(device.write(static_cast<const char*>(data), static_cast<qint64>(size)) != static_cast<qint64>(size))
+                    throw Error( "Error writing project file:  " + device.errorString() );
+            }
+
+            void number(std::uint64_t v, int bytes)
+            {
+                std::string s;
+                putLE(s, v, bytes);
+                raw(s.data(), s.size());
+            }
+
+            template <typename T>
+            void array(const std::vector<T>& v)             { raw(v.data(), v.size() * sizeof(T));     }
+
+        private:
+            QIODevice&      device;
+        };
+
+        //  The string table.  Each distinct string is only stored once.
+        class StringTable
+        {
+        public:
+            std::uint32_t get(const std::string& s)
+            {
+                auto i = lookup.find(s);
+                if(i != lookup.end())
+                    return i->second;
+
+                auto index = static_cast<std::uint32_t>(lengths.size());
+                lookup.emplace(s, index);
+                lengths.push_back( static_cast<std::uint32_t>(s.size()) );
+                data += s;
+                return index;
+            }
+
+            void write(Output& out) const
+            {
+                out.number(lengths.size(), 4);
+                out.array(lengths);
+                out.raw(data.data(), data.size());
+            }
+
+        private:
+            std::unordered_map<std::string, std::uint32_t>  lookup;
+            std::vector<std::uint32_t>                      lengths;
+            std::string                                     data;
+        };
+
+        //////////////////////////////////////////////////////////////////
+        //  Reading
+
+        class Input
+        {
+        public:
+            Input(const uchar* data, std::size_t size) : pos(data), end(data + size) {}
+
+            const uchar* take(std::uint64_t bytes)
+            {
+                if(bytes > static_cast<std::uint64_t>(end - pos))
+                    damaged();
+                auto p = pos;
+                pos += bytes;
+                return p;
+            }
+
+            std::uint64_t number(int bytes)                 { return getLE(take(bytes), bytes);      }
+
+            std::uint64_t varint()
+            {
+                std::uint64_t v = 0;
+                for(int shift = 0; shift < 64; shift += 7)
+                {
+                    auto b = *take(1);
+                    v |= static_cast<std::uint64_t>(b & 0x7F) << shift;
+                    if(!(b & 0x80))
+                        return v;
+                }
+                damaged();
+            }
+
+            template <typename T>
+            void array(std::vector<T>& out, std::uint64_t count)
+            {
+                if(count > static_cast<std::uint64_t>(end - pos) / sizeof(T))
+                    damaged();
+                out.resize( static_cast<std::size_t>(count) );
+                if(count)
+                    std::memcpy(out.data(), take(count * sizeof(T)), static_cast<std::size_t>(count * sizeof(T)));
+            }
+
+            [[noreturn]] static void damaged()
+            {
+                throw Error( "Project file is damaged or incomplete" );
+            }
+
+        private:
+            const uchar*    pos;
+            const uchar*    end;
+        };
+
+        struct StringRef
+        {
+            const char*     data;
+            std::uint32_t   size;
+        };
+
+        //  Unmaps the file when the read is done, however it ends
+        struct FileMapping
+        {
+            QFile*      file;
+            uchar*      data;
+
+            ~FileMapping()          { if(data) file->unmap(data);    }
+        };
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //////////////////////////////////////////////////////////////////
+
+    bool BinaryProjectFile::isBinary(QIODevice& device)
+    {
+        auto start = device.peek( sizeof(fileSignature) );
+        return start.size() == sizeof(fileSignature) && !std::memcmp(start.constData(), fileSignature, sizeof(fileSignature));
+    }
+
+    void BinaryProjectFile::write(QIODevice& device, const json::object& blocks, const DataStore& dat)
+    {
+        StringTable                 strings;
+        std::string                 keys;
+        std::uint64_t               keyCount = 0;
+        const std::string*          prevKey = nullptr;
+        std::vector<std::size_t>    prevEnds;       // where each part of the previous key ends
+        std::vector<std::uint32_t>  newParts;
+
+        std::vector<std::uint8_t>   types;
+        std::vector<std::int64_t>   ints;
+        std::vector<double>         dbls;
+        std::vector<std::uint8_t>   bools;
+        std::vector<std::uint32_t>  strLengths;
+        std::string                 strData;
+        std::vector<std::uint32_t>  objTags;
+        std::vector<std::int64_t>   objOffsets;
+        std::vector<std::int64_t>   objSizes;
+
+        for(auto& i : dat)
+        {
+            auto& v = i.second;
+            switch(v.getType())
+            {
+            case ProjectData::Type::Bool:   types.push_back(tBool);     bools.push_back( v.asBool() ? 1 : 0 );      break;
+            case ProjectData::Type::Int:    types.push_back(tInt);      ints.push_back( v.asInt() );                break;
+            case ProjectData::Type::Dbl:    types.push_back(tDbl);      dbls.push_back( v.asDbl() );                break;
+            case ProjectData::Type::Str:
+                types.push_back(tStr);
+                strLengths.push_back( static_cast<std::uint32_t>(v.asString().size()) );
+                strData += v.asString();
+                break;
+            case ProjectData::Type::Obj:
+                {
+                    //  Same rule as the json:  only objects that made it into the object file are saved
+                    auto& obj = v.asStoredObj();
+                    std::int64_t at, size;
+                    if(!obj || !obj->isStorable() || !obj->getLocation(at, size))
+                        continue;
+                    types.push_back(tObj);
+                    objTags.push_back( strings.get(obj->getTag()) );
+                    objOffsets.push_back( at );
+                    objSizes.push_back( size );
+                }
+                break;
+            default:
+                continue;
+            }
+
+            //  The key.  Keys are sorted, so they usually start with the same parts as the key before
+            //    them -- only the number of those is stored, then whatever parts are left.  (keys are never
+            //    the same, and the previous key is never a part of this one, so there's always at least one)
+            auto& key = i.first;
+            std::size_t common = 0;
+            if(prevKey)
+            {
+                auto limit = std::min(key.size(), prevKey->size());
+                while(common < limit && key[common] == (*prevKey)[common])
+                    ++common;
+            }
+
+            std::size_t shared = 0;
+            while(shared < prevEnds.size() && prevEnds[shared] <= common && (prevEnds[shared] == key.size() || key[prevEnds[shared]] == '.'))
+                ++shared;
+            prevEnds.resize(shared);
+
+            for(std::size_t p = shared ? prevEnds.back() + 1 : 0; ; )
+            {
+                auto dot = key.find('.', p);
+                auto end = (dot == key.npos) ? key.size() : dot;
+                newParts.push_back( strings.get( key.substr(p, end - p) ) );
+                prevEnds.push_back(end);
+                if(dot == key.npos)
+                    break;
+                p = dot + 1;
+            }
+
+            putVarint(keys, shared);
+            putVarint(keys, newParts.size());
+            for(auto n : newParts)
+                putVarint(keys, n);
+            newParts.clear();
+            prevKey = &key;
+            ++keyCount;
+        }
+
+        //////////////////////////////////////////////
+        //  Write it all out
+        Output out(device);
+
+        auto settings = json::value(blocks).serialize(false);
+        out.raw(fileSignature, sizeof(fileSignature));
+        out.number(fileVersion, 4);
+        out.number(settings.size(), 4);
+        out.raw(settings.data(), settings.size());
+
+        strings.write(out);
+
+        out.number(keyCount, 8);
+        out.number(keys.size(), 8);
+        out.raw(keys.data(), keys.size());
+
+        out.array(types);
+        out.array(ints);
+        out.array(dbls);
+        out.array(bools);
+        out.array(strLengths);
+        out.raw(strData.data(), strData.size());
+        out.array(objTags);
+        out.array(objOffsets);
+        out.array(objSizes);
+    }
+
+    void BinaryProjectFile::read(QIODevice& device, json::object& blocks, DataStore::ItemList& items, RefList& objectRefs)
+    {
+        //  Map the file if possible.  Otherwise, just read it all in.
+        auto file = dynamic_cast<QFile*>(&device);
+        std::size_t size = 0;
+        FileMapping map{ file, file ? file->map(0, file->size()) : nullptr };
+        QByteArray copy;
+        const uchar* data = map.data;
+        if(data)
+            size = static_cast<std::size_t>( file->size() );
+        else
+        {
+            copy = device.readAll();
+            size = static_cast<std::size_t>(copy.size());
+            data = reinterpret_cast<const uchar*>(copy.constData());
+        }
+
+        Input in(data, size);
+
+        //////////////////////////////////////////////
+        //  Header and settings
+        if(std::memcmp(in.take(sizeof(fileSignature)), fileSignature, sizeof(fileSignature)))
+            throw Error( "File is not a binary Lusch project file" );
+        if(in.number(4) > fileVersion)
+            throw Error( "Project file was saved by a newer version of Lusch, and cannot be opened" );
+
+        {
+            auto len = in.number(4);
+            auto p = reinterpret_cast<const char*>( in.take(len) );
+            json::value v;
+            std::string err;
+            json::fastParse(v, p, p + len, &err);
+            if(!err.empty() || !v.is<json::object>())
+                Input::damaged();
+            blocks = std::move(v.get<json::object>());
+        }
+
+        //////////////////////////////////////////////
+        //  String table
+        std::vector<StringRef> strings;
+        {
+            std::vector<std::uint32_t> lengths;
+            in.array(lengths, in.number(4));
+            strings.reserve(lengths.size());
+            for(auto len : lengths)
+                strings.push_back( StringRef{ reinterpret_cast<const char*>(in.take(len)), len } );
+        }
+
+        //////////////////////////////////////////////
+        //  Keys and value types
+        auto keyCount = in.number(8);
+        std::uint64_t keysSize = in.number(8);
+        Input keys( in.take(keysSize), static_cast<std::size_t>(keysSize) );
+
+        std::vector<std::uint8_t> types;
+        in.array(types, keyCount);
+
+        std::size_t counts[tObj + 1] = {};
+        for(auto t : types)
+        {
+            if(t < tBool || t > tObj)
+                Input::damaged();
+            ++counts[t];
+        }
+
+        //////////////////////////////////////////////
+        //  The value arrays
+        std::vector<std::int64_t>   ints;           in.array(ints, counts[tInt]);
+        std::vector<double>         dbls;           in.array(dbls, counts[tDbl]);
+        std::vector<std::uint8_t>   bools;          in.array(bools, counts[tBool]);
+        std::vector<std::uint32_t>  strLengths;     in.array(strLengths, counts[tStr]);
+        std::uint64_t strTotal = 0;
+        for(auto len : strLengths)
+            strTotal += len;
+        auto strData = reinterpret_cast<const char*>( in.take(strTotal) );
+        std::vector<std::uint32_t>  objTags;        in.array(objTags, counts[tObj]);
+        std::vector<std::int64_t>   objOffsets;     in.array(objOffsets, counts[tObj]);
+        std::vector<std::int64_t>   objSizes;       in.array(objSizes, counts[tObj]);
+
+        //////////////////////////////////////////////
+        //  Put it all together
+        items.reserve( items.size() + types.size() );
+
+        std::size_t next[tObj + 1] = {};            // position in each value array
+        std::string key;
+        std::vector<std::size_t> ends;              // where each part of 'key' ends
+        for(auto t : types)
+        {
+            auto shared = keys.varint();
+            auto added = keys.varint();
+            if(shared > ends.size() || !added)
+                Input::damaged();
+
+            ends.resize( static_cast<std::size_t>(shared) );
+            key.resize( shared ? ends.back() : 0 );
+            for(std::uint64_t p = 0; p < added; ++p)
+            {
+                auto n = keys.varint();
+                if(n >= strings.size())
+                    Input::damaged();
+                if(!ends.empty())
+                    key += '.';
+                key.append( strings[n].data, strings[n].size );
+                ends.push_back( key.size() );
+            }
+
+            auto n = next[t]++;
+            switch(t)
+            {
+            case tBool:     items.emplace_back( key, ProjectData(bools[n] != 0) );     break;
+            case tInt:      items.emplace_back( key, ProjectData(static_cast<ProjectData::int_t>(ints[n])) );  break;
+            case tDbl:      items.emplace_back( key, ProjectData(dbls[n]) );           break;
+            case tStr:
+                items.emplace_back( key, ProjectData(std::string(strData, strLengths[n])) );
+                strData += strLengths[n];
+                break;
+            case tObj:
+                {
+                    if(objTags[n] >= strings.size())
+                        Input::damaged();
+                    json::object ref;
+                    ref["$obj"] = json::value( std::string(strings[objTags[n]].data, strings[objTags[n]].size) );
+                    ref["at"]   = json::value( objOffsets[n] );
+                    ref["size"] = json::value( objSizes[n] );
+                    objectRefs.emplace_back( key, json::value(std::move(ref)) );
+                }
+                break;
+            }
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef LUSCH_CORE_BINARYPROJECT_H_INCLUDED
+#define LUSCH_CORE_BINARYPROJECT_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <QIODevice>
+#include "util/qtjson.h"
+#include "datastore.h"
+
+/*
+    The binary project file format.  This is an alternative to the json project file, selected with
+    "saveBinary" in the project's misc settings.  Opening a project works with either format -- the
+    format is detected from the start of the file -- so switching the setting and saving converts a
+    project from one to the other.  Nothing is lost either way:  the binary file holds exactly what the
+    json one would.
+
+    Everything other than the data (header, blueprint, files, sections, misc settings) is small and
+    rarely looked at, so it's kept as a block of compact json.  The data is split up so that it can be
+    read back in big chunks rather than parsed:
+
+        - 8 byte signature, 4 byte version, 4 byte size of the settings json, then the settings json
+        - the string table:  4 byte count, 4 byte length of each string, then all of the strings
+            back to back.  Every distinct '.' separated part of every key is in here once, along with
+            the storage tag of every stored object.
+        - the keys:  8 byte key count, 8 byte size of the key list, then the key list.  Keys are in
+            DataStore order, so each one usually starts with the same parts as the one before it.  For
+            each key, the list has the number of parts it shares with the previous key, the number of
+            parts after that, and the string index of each of those.  These are all varints (7 bits
+            per byte, low bits first, high bit set on every byte but the last).
+        - the values:  1 byte type per key, then a packed array for each type holding the values of that
+            type, in key order:  ints (8 bytes each), doubles (8 bytes each), bools (1 byte each),
+            strings (4 byte length each, then the strings back to back), and stored objects (4 byte
+            string index of the tag each, then 8 byte offsets, then 8 byte sizes).  Object values refer
+            to the object file, exactly like the json "$obj" references do (see objectsidecar.h).
+
+    Everything is little endian.  The number arrays are copied straight out of the file (which is memory
+    mapped, if it's being read directly from a QFile).
+ */
+
+namespace lsh
+{
+    class BinaryProjectFile
+    {
+    public:
+        //  Object values, as json references.  (resolved once the object file is open, same as when
+        //    loading json)
+        typedef std::vector<std::pair<std::string, json::value>>    RefList;
+
+        static bool     isBinary(QIODevice& device);        // peeks at the start of an open device
+
+        static void     write(QIODevice& device, const json::object& blocks, const DataStore& dat);
+        static void     read(QIODevice& device, json::object& blocks, DataStore::ItemList& items, RefList& objectRefs);
+    };
+}
+
+#endif
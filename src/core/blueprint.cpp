@@ -6,6 +6,8 @@
 #include "log.h"
 #include <set>
 #include <unordered_set>
+#include <algorithm>
+#include <cctype>
 #include "fileinfo.h"
 #include "lua/lua_stacksaver.h"
 
@@ -20,6 +22,11 @@ namespace lsh
             "post-import",
             "post-export",
         };
+
+        bool isHex(const std::string& str, std::size_t digits)
+        {
+            return str.size() == digits && std::all_of( str.begin(), str.end(), [] (char c) { return std::isxdigit(static_cast<unsigned char>(c)) != 0; } );
+        }
     }
 
     void Blueprint::unload()
@@ -52,7 +59,7 @@ namespace lsh
         auto file = dir.openFile("index.json", false);
         if(!file->isOpen())                     throw Error("Blueprint does not contain an 'index.json' file or the file was unable to be opened.");
 
-        auto dat = json::loadFromFile(*file);
+        auto dat = json::loadDocument(*file);
 
         // Now that we have the parsed json -- load the primary header
         auto i = dat.find("header");
@@ -93,6 +100,22 @@ namespace lsh
                     else                                    files.emplace_back(std::move(inf));
                 }
             }
+
+            //  A patch has to be of a normal file, which is listed
+            for(auto f = files.begin(); f != files.end(); )
+            {
+                if(!f->patchOf.empty())
+                {
+                    auto base = std::find_if( files.begin(), files.end(), [&] (const FileInfo& x) { return x.id == f->patchOf; } );
+                    if(f->directory || base == files.end() || base->directory || !base->patchOf.empty())
+                    {
+                        Log::wrn("File '" + f->id + "' in Blueprint 'files' is a patch of '" + f->patchOf + "', which is not a file, or is a patch itself.");
+                        f = files.erase(f);
+                        continue;
+                    }
+                }
+                ++f;
+            }
         }
 
         // Then the 'sections'
@@ -144,14 +167,15 @@ namespace lsh
         }
     }
 
-    Blueprint::SectionInfo Blueprint::loadSectionInfoFromJson(const json::object& info)
+    template <typename Object>
+    Blueprint::SectionInfo Blueprint::readSectionInfo(const Object& info)
     {
         SectionInfo out;
         for(auto& i : info)
         {
-            if      (i.first == "name"   && i.second.is<std::string>())     out.id =            i.second.get<std::string>();
-            else if (i.first == "import" && i.second.is<std::string>())     out.importFunc =    i.second.get<std::string>();
-            else if (i.first == "export" && i.second.is<std::string>())     out.exportFunc =    i.second.get<std::string>();
+            if      (i.first == "name"   && i.second.template is<std::string>())     out.id =            i.second.template get<std::string>();
+            else if (i.first == "import" && i.second.template is<std::string>())     out.importFunc =    i.second.template get<std::string>();
+            else if (i.first == "export" && i.second.template is<std::string>())     out.exportFunc =    i.second.template get<std::string>();
             else
             {
                 Log::wrn("Entry in Blueprint 'sections' has a field '" + i.first + "' that is unrecognized, or is of an unexpected type.");
@@ -166,16 +190,30 @@ namespace lsh
         return SectionInfo();
     }
     
-    FileInfo Blueprint::loadFileInfoFromJson(const json::object& info)
+    template <typename Object>
+    FileInfo Blueprint::readFileInfo(const Object& info)
     {
         FileInfo out;
         for(auto& i : info)
         {
-            if      (i.first == "id"     && i.second.is<std::string>())     out.id =            i.second.get<std::string>();
-            else if (i.first == "name"   && i.second.is<std::string>())     out.displayName =   QString::fromStdString( i.second.get<std::string>() );
-            else if (i.first == "optional"  && i.second.is<bool>())         out.optional =      i.second.get<bool>();
-            else if (i.first == "directory" && i.second.is<bool>())         out.directory =     i.second.get<bool>();
-            else if (i.first == "write"     && i.second.is<bool>())         out.writable =      i.second.get<bool>();
+            if      (i.first == "id"     && i.second.template is<std::string>())     out.id =            i.second.template get<std::string>();
+            else if (i.first == "name"   && i.second.template is<std::string>())     out.displayName =   QString::fromStdString( i.second.template get<std::string>() );
+            else if (i.first == "optional"  && i.second.template is<bool>())         out.optional =      i.second.template get<bool>();
+            else if (i.first == "directory" && i.second.template is<bool>())         out.directory =     i.second.template get<bool>();
+            else if (i.first == "write"     && i.second.template is<bool>())         out.writable =      i.second.template get<bool>();
+            else if (i.first == "patch of"  && i.second.template is<std::string>())  out.patchOf =       i.second.template get<std::string>();
+            //  The file's fingerprint (see util/romfingerprint.h):  "crc32" is 8 hex digits, "sha1" is 40
+            else if (i.first == "size"      && i.second.template is<std::int64_t>() && i.second.template get<std::int64_t>() >= 0)
+                out.expected.size = i.second.template get<std::int64_t>();
+            else if (i.first == "crc32"     && i.second.template is<std::string>() && isHex(i.second.template get<std::string>(), 8))
+            {
+                out.expected.crc32 = static_cast<std::uint32_t>( std::stoul(i.second.template get<std::string>(), nullptr, 16) );
+                out.expected.hasCrc32 = true;
+            }
+            else if (i.first == "sha1"      && i.second.template is<std::string>() && isHex(i.second.template get<std::string>(), 40))
+                out.expected.sha1 = QByteArray::fromStdString( i.second.template get<std::string>() ).toLower();
+            else if (i.first == "header"    && i.second.template is<std::string>() && i.second.template get<std::string>() == "ines")
+                out.skipInesHeader = true;
             else
             {
                 Log::wrn("Entry in Blueprint 'files' has a field '" + i.first + "' that is unrecognized, or is of an unexpected type.");
@@ -189,6 +227,11 @@ namespace lsh
 
         return FileInfo();
     }
+
+    Blueprint::SectionInfo Blueprint::loadSectionInfoFromJson(const json::object& info)         { return readSectionInfo(info);     }
+    Blueprint::SectionInfo Blueprint::loadSectionInfoFromJson(const json::doc::object& info)    { return readSectionInfo(info);     }
+    FileInfo Blueprint::loadFileInfoFromJson(const json::object& info)                          { return readFileInfo(info);        }
+    FileInfo Blueprint::loadFileInfoFromJson(const json::doc::object& info)                     { return readFileInfo(info);        }
     
     /////////////////////////////////////////////////////////////
     /////////////////////////////////////////////////////////////
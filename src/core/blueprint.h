@@ -48,7 +48,13 @@ namespace lsh
 
         void        loadIndexFile(DirTraverser& dir);
         static FileInfo     loadFileInfoFromJson(const json::object& info);
+        static FileInfo     loadFileInfoFromJson(const json::doc::object& info);
         static SectionInfo  loadSectionInfoFromJson(const json::object& info);
+        static SectionInfo  loadSectionInfoFromJson(const json::doc::object& info);
+
+        //  The bodies of the above, for either kind of object
+        template <typename Object> static FileInfo      readFileInfo(const Object& info);
+        template <typename Object> static SectionInfo   readSectionInfo(const Object& info);
 
     };
 
@@ -0,0 +1,186 @@
+
+#include <algorithm>
+#include "datastore.h"
+
+namespace lsh
+{
+    DataStore::Node::Node(const value_type& v, const NodePtr& l, const NodePtr& r)
+        : kv(v)
+        , left(l)
+        , right(r)
+    {
+        height = std::max( DataStore::height(l), DataStore::height(r) ) + 1;
+    }
+
+    DataStore::Node::Node(std::string&& k, ProjectData&& v, const NodePtr& l, const NodePtr& r)
+        : kv(std::move(k), std::move(v))
+        , left(l)
+        , right(r)
+    {
+        height = std::max( DataStore::height(l), DataStore::height(r) ) + 1;
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //////////////////////////////////////////////////////////////////
+
+    bool DataStore::keyLess(const std::string& a, const std::string& b)
+    {
+        auto n = std::min(a.size(), b.size());
+        auto pa = a.data();
+        auto pb = b.data();
+
+        std::size_t i = 0;
+        while(i < n && pa[i] == pb[i])
+            ++i;
+
+        if(i == n)                  return a.size() < b.size();
+        if(pa[i] == '.')            return true;
+        if(pb[i] == '.')            return false;
+        return static_cast<unsigned char>(pa[i]) < static_cast<unsigned char>(pb[i]);
+    }
+
+    const ProjectData* DataStore::find(const std::string& key) const
+    {
+        const Node* n = root.get();
+        while(n)
+        {
+            if     (keyLess(key, n->kv.first))      n = n->left.get();
+            else if(keyLess(n->kv.first, key))      n = n->right.get();
+            else                            return &n->kv.second;
+        }
+        return nullptr;
+    }
+
+    void DataStore::set(const std::string& key, const ProjectData& v)
+    {
+        bool added = false;
+        root = insert(root, key, v, added);
+        if(added)
+            ++count;
+    }
+
+    void DataStore::assign(ItemList&& items)
+    {
+        auto less = [] (const ItemList::value_type& a, const ItemList::value_type& b) { return keyLess(a.first, b.first); };
+        if(!std::is_sorted(items.begin(), items.end(), less))
+            std::stable_sort(items.begin(), items.end(), less);
+
+        //  Remove duplicates, keeping the last of each
+        std::size_t out = 0;
+        for(std::size_t i = 0; i < items.size(); ++i)
+        {
+            if(i + 1 < items.size() && !keyLess(items[i].first, items[i+1].first))
+                continue;
+            if(out != i)
+                items[out] = std::move(items[i]);
+            ++out;
+        }
+        items.resize(out);
+
+        root = build(items, 0, items.size());
+        count = items.size();
+    }
+
+    //  A perfectly balanced tree is always a valid AVL tree
+    DataStore::NodePtr DataStore::build(ItemList& items, std::size_t first, std::size_t last)
+    {
+        if(first >= last)
+            return nullptr;
+
+        auto mid = first + (last - first) / 2;
+        auto l = build(items, first, mid);
+        auto r = build(items, mid + 1, last);
+        return std::make_shared<const Node>( std::move(items[mid].first), std::move(items[mid].second), l, r );
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //  Tree building -- nothing here ever modifies an existing node.  Everything that would
+    //    change gets rebuilt instead.
+
+    DataStore::NodePtr DataStore::makeNode(const value_type& kv, const NodePtr& l, const NodePtr& r)
+    {
+        return std::make_shared<const Node>(kv, l, r);
+    }
+
+    DataStore::NodePtr DataStore::balance(const value_type& kv, const NodePtr& l, const NodePtr& r)
+    {
+        int hl = height(l);
+        int hr = height(r);
+
+        if(hl > hr + 1)                 // left heavy
+        {
+            if(height(l->left) >= height(l->right))     // single rotation (right)
+                return makeNode(l->kv, l->left, makeNode(kv, l->right, r));
+            else                                        // double rotation (left-right)
+            {
+                auto& lr = l->right;
+                return makeNode(lr->kv, makeNode(l->kv, l->left, lr->left), makeNode(kv, lr->right, r));
+            }
+        }
+        else if(hr > hl + 1)            // right heavy
+        {
+            if(height(r->right) >= height(r->left))     // single rotation (left)
+                return makeNode(r->kv, makeNode(kv, l, r->left), r->right);
+            else                                        // double rotation (right-left)
+            {
+                auto& rl = r->left;
+                return makeNode(rl->kv, makeNode(kv, l, rl->left), makeNode(r->kv, rl->right, r->right));
+            }
+        }
+
+        return makeNode(kv, l, r);
+    }
+
+    DataStore::NodePtr DataStore::insert(const NodePtr& n, const std::string& key, const ProjectData& v, bool& added)
+    {
+        if(!n)
+        {
+            added = true;
+            return makeNode(value_type(key, v), nullptr, nullptr);
+        }
+
+        if(keyLess(key, n->kv.first))           return balance(n->kv, insert(n->left, key, v, added), n->right);
+        else if(keyLess(n->kv.first, key))      return balance(n->kv, n->left, insert(n->right, key, v, added));
+
+        // replacing an existing value -- the shape of the tree doesn't change
+        return makeNode(value_type(key, v), n->left, n->right);
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //////////////////////////////////////////////////////////////////
+
+    DataStore::const_iterator DataStore::begin() const
+    {
+        const_iterator out;
+        for(const Node* n = root.get(); n; n = n->left.get())
+            out.stack.push_back(n);
+        return out;
+    }
+
+    DataStore::const_iterator DataStore::lowerBound(const std::string& key) const
+    {
+        // Only nodes that are >= key get pushed, which leaves the stack exactly as if we had
+        //   iterated up to that point from begin()
+        const_iterator out;
+        const Node* n = root.get();
+        while(n)
+        {
+            if(keyLess(n->kv.first, key))   n = n->right.get();
+            else
+            {
+                out.stack.push_back(n);
+                n = n->left.get();
+            }
+        }
+        return out;
+    }
+
+    DataStore::const_iterator& DataStore::const_iterator::operator ++ ()
+    {
+        const Node* n = stack.back()->right.get();
+        stack.pop_back();
+        for(; n; n = n->left.get())
+            stack.push_back(n);
+        return *this;
+    }
+}
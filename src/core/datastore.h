@@ -0,0 +1,116 @@
+#ifndef LUSCH_CORE_DATASTORE_H_INCLUDED
+#define LUSCH_CORE_DATASTORE_H_INCLUDED
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <cstddef>
+#include "projectdata.h"
+
+/*
+    The DataStore is where all of a project's data lives.  It's a map of name -> ProjectData, but it's
+    a persistent one:  nodes are never modified once they're built.  Setting a value builds a new path
+    from the root down to that value (an AVL tree, so that's O(log n) nodes), and everything else is
+    shared with the previous version of the tree.
+
+    The point of all that is that copying a DataStore is just copying the root pointer.  So taking a
+    snapshot of the entire project (for undo, or to hand to another thread) costs nothing, and each
+    edit only costs memory proportional to the edit.
+
+    Iteration is in key order -- with one twist:  '.' sorts before every other character.  That makes key
+    order the same as the order of a tree where each '.' separated part is a level ("a.b" and "a.c" are
+    members of "a"), so everything under "a." comes immediately after "a", and before "a-b" or "aa".
+    See keyLess.
+
+    Nodes are immutable, so any number of threads can read DataStores which share nodes.  A single
+    DataStore object is not thread safe, though -- each thread needs its own copy.
+ */
+
+namespace lsh
+{
+    class DataStore
+    {
+    public:
+        typedef std::pair<const std::string, ProjectData>   value_type;
+
+    private:
+        struct Node;
+        typedef std::shared_ptr<const Node>     NodePtr;
+
+        struct Node
+        {
+            Node(const value_type& v, const NodePtr& l, const NodePtr& r);
+            Node(std::string&& k, ProjectData&& v, const NodePtr& l, const NodePtr& r);
+
+            value_type      kv;
+            NodePtr         left;
+            NodePtr         right;
+            int             height;
+        };
+
+    public:
+        class const_iterator
+        {
+        public:
+            typedef std::forward_iterator_tag   iterator_category;
+            typedef DataStore::value_type       value_type;
+            typedef std::ptrdiff_t              difference_type;
+            typedef const value_type*           pointer;
+            typedef const value_type&           reference;
+
+            const value_type&   operator * () const     { return stack.back()->kv;      }
+            const value_type*   operator -> () const    { return &stack.back()->kv;     }
+            const_iterator&     operator ++ ();
+            const_iterator      operator ++ (int)       { auto x = *this; ++*this; return x;    }
+            bool                operator == (const const_iterator& rhs) const   { return stack == rhs.stack;    }
+            bool                operator != (const const_iterator& rhs) const   { return stack != rhs.stack;    }
+
+        private:
+            friend class DataStore;
+            std::vector<const Node*>    stack;      // path from the root to the current node (only nodes still to be visited)
+        };
+
+        ////////////////////////////////////////
+                            DataStore() = default;
+                            DataStore(const DataStore&) = default;
+        DataStore&          operator = (const DataStore&) = default;
+                            DataStore(DataStore&& rhs)                  : root(std::move(rhs.root)), count(rhs.count)   { rhs.count = 0;    }
+        DataStore&          operator = (DataStore&& rhs)                { root = std::move(rhs.root); count = rhs.count; rhs.count = 0; return *this;   }
+
+        std::size_t         size() const                { return count;             }
+        bool                empty() const               { return count == 0;        }
+        void                clear()                     { root.reset(); count = 0;  }
+
+        // true if both stores are the exact same version (ie, one is an untouched copy of the other)
+        bool                isSameVersionAs(const DataStore& rhs) const     { return root == rhs.root;  }
+
+        const ProjectData*  find(const std::string& key) const;
+        void                set(const std::string& key, const ProjectData& v);
+
+        //  Replace everything with 'items'.  Much faster than setting them one at a time, since the tree is
+        //    built directly (and is O(n) if they're already sorted by keyLess).  Later duplicates win.
+        typedef std::vector<std::pair<std::string, ProjectData>>    ItemList;
+        void                assign(ItemList&& items);
+
+        const_iterator      begin() const;
+        const_iterator      end() const                 { return const_iterator();  }
+        const_iterator      lowerBound(const std::string& key) const;
+
+        static bool         keyLess(const std::string& a, const std::string& b);    // the order keys are stored in
+
+    private:
+        NodePtr             root;
+        std::size_t         count = 0;
+
+        static int          height(const NodePtr& n)    { return n ? n->height : 0; }
+        static NodePtr      makeNode(const value_type& kv, const NodePtr& l, const NodePtr& r);
+        static NodePtr      balance(const value_type& kv, const NodePtr& l, const NodePtr& r);
+        static NodePtr      insert(const NodePtr& n, const std::string& key, const ProjectData& v, bool& added);
+        static NodePtr      build(ItemList& items, std::size_t first, std::size_t last);
+    };
+
+}
+
+#endif
@@ -4,6 +4,7 @@
 #include <string>
 #include <QString>
 #include "util/filename.h"
+#include "util/romfingerprint.h"
 
 namespace lsh
 {
@@ -15,6 +16,9 @@ namespace lsh
         bool            optional        = false;
         bool            directory       = false;// if a directory, 'fileName' should not have a title or extension
         bool            writable        = false;
+        std::string     patchOf;                // if not empty, this file is an IPS/BPS patch of the file with this ID (see romimagecache.h)
+        RomFingerprint  expected;               // what the file has to match before anything is imported from it.  Empty if anything goes
+        bool            skipInesHeader  = false;// fingerprint it without an iNES header, if it has one
     };
 
     struct FileFlags
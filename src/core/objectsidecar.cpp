@@ -0,0 +1,497 @@
+
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include <mutex>
+#include <set>
+#include <QFile>
+#include <QFileInfo>
+#include "objectsidecar.h"
+#include "error.h"
+#include "log.h"
+
+namespace lsh
+{
+    namespace
+    {
+        const char              sidecarSignature[8] = { 'L', 'S', 'H', 'O', 'B', 'J', '\r', '\n' };
+        const std::uint32_t     sidecarVersion = 1;
+        const std::int64_t      headerSize = 8 + 4 + 8;             // signature, version, save id
+
+        //  StoredObjects can be reached from data snapshots on other threads (see Project::getSnapshot).  Plain
+        //    values need no locking, but loading an object and moving it between files do, so this guards
+        //    every StoredObject's loaded/mapped/detached state and its location in the file.
+        std::mutex              objectMutex;
+
+        void putLE(std::string& out, std::uint64_t v, int bytes)
+        {
+            for(int i = 0; i < bytes; ++i)
+                out.push_back( static_cast<char>( (v >> (i*8)) & 0xFF ) );
+        }
+
+        std::uint64_t getLE(const uchar* p, int bytes)
+        {
+            std::uint64_t v = 0;
+            for(int i = bytes-1; i >= 0; --i)
+                v = (v << 8) | p[i];
+            return v;
+        }
+
+        //  The save id of a sidecar file, or -1 if it isn't one
+        std::int64_t readSaveId(const QString& filename)
+        {
+            QFile file(filename);
+            if(!file.open(QIODevice::ReadOnly))
+                return -1;
+
+            auto hdr = file.read(headerSize);
+            auto p = reinterpret_cast<const uchar*>(hdr.constData());
+            if(hdr.size() != headerSize || std::memcmp(p, sidecarSignature, sizeof(sidecarSignature)) || getLE(p + 8, 4) != sidecarVersion)
+                return -1;
+            return static_cast<std::int64_t>(getLE(p + 12, 8));
+        }
+
+        std::string makeHeader(std::int64_t saveId)
+        {
+            std::string out(sidecarSignature, sizeof(sidecarSignature));
+            putLE(out, sidecarVersion, 4);
+            putLE(out, static_cast<std::uint64_t>(saveId), 8);
+            return out;
+        }
+
+        //  Writes one record, and returns the offset its data ended up at ('pos' is the current end of the file)
+        std::int64_t writeRecord(QFile& file, std::int64_t& pos, const std::string& tag, const std::string& data)
+        {
+            std::string hdr;
+            putLE(hdr, tag.size(), 4);
+            hdr += tag;
+            putLE(hdr, data.size(), 8);
+
+            if( file.write(hdr.data(), hdr.size()) != static_cast<qint64>(hdr.size()) ||
+                file.write(data.data(), data.size()) != static_cast<qint64>(data.size()) )
+            {
+                throw Error( "Error writing to object file '" + file.fileName() + "':  " + file.errorString() );
+            }
+
+            std::int64_t dataPos = pos + hdr.size();
+            pos = dataPos + data.size();
+            return dataPos;
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //  A mapped sidecar file.  Objects which haven't been loaded yet point in to this.
+
+    class SidecarMapping
+    {
+    public:
+        QFile                                       file;
+        const uchar*                                data = nullptr;
+        std::int64_t                                size = 0;
+        QByteArray                                  copy;           // what 'data' points to, if the file couldn't be mapped again after a move
+        std::vector<std::weak_ptr<StoredObject>>    users;          // every object with an offset in this file
+
+        ~SidecarMapping()
+        {
+            if(data && copy.isEmpty())
+                file.unmap( const_cast<uchar*>(data) );
+        }
+
+        //  Renames the file out from under everything using it.  The contents don't change, so neither
+        //    does anything pointing in to it -- only the mapping has to be redone, since a mapped file
+        //    can't be renamed on Windows.
+        bool moveTo(const QString& filename)
+        {
+            std::lock_guard<std::mutex> lock(objectMutex);
+            QString oldname = file.fileName();
+
+            file.unmap( const_cast<uchar*>(data) );
+            data = nullptr;
+            file.close();
+            QFile::remove(filename);
+            bool moved = QFile::rename(oldname, filename);
+
+            file.setFileName( moved ? filename : oldname );
+            if(!file.open(QIODevice::ReadOnly))
+                throw Error( "Unable to open object file '" + file.fileName() + "' again after moving it" );
+            data = file.map(0, size);
+            if(!data)
+            {
+                copy = file.read(size);
+                if(copy.size() != size)
+                    throw Error( "Unable to read object file '" + file.fileName() + "' again after moving it" );
+                data = reinterpret_cast<const uchar*>(copy.constData());
+            }
+            return moved;
+        }
+
+        //  Called when this file is about to be replaced.  Anything still depending on it gets its own
+        //    copy of its bytes, and is no longer considered to be in the sidecar.
+        void release()
+        {
+            std::lock_guard<std::mutex> lock(objectMutex);
+            for(auto& w : users)
+            {
+                auto u = w.lock();
+                if(!u)              continue;
+
+                if(u->map.get() == this)
+                {
+                    if(!u->obj)
+                        u->detached.assign( reinterpret_cast<const char*>(data + u->offset), static_cast<std::size_t>(u->size) );
+                    u->map.reset();
+                }
+                u->offset = -1;
+            }
+            users.clear();
+        }
+    };
+
+    //////////////////////////////////////////////////////////////////
+    //////////////////////////////////////////////////////////////////
+
+    StoredObject::Ptr StoredObject::fromObject(const LuaObject::Ptr& obj)
+    {
+        auto out = std::make_shared<StoredObject>();
+        out->obj = obj;
+
+        auto tag = obj ? obj->getStorageTag() : nullptr;
+        if(tag)
+            out->tag = tag;
+        return out;
+    }
+
+    LuaObject::Ptr StoredObject::get() const
+    {
+        std::lock_guard<std::mutex> lock(objectMutex);
+        if(obj || !isStorable())
+            return obj;
+
+        auto& loaders = ObjectSidecar::loaders();
+        auto i = loaders.find(tag);
+        if(i == loaders.end())
+            throw Error( "Unable to load stored object:  no loader for objects of type '" + tag + "'" );
+
+        if(map && !map->data)
+            throw Error( "Unable to load stored object:  its object file could not be read" );
+        if(map)     obj = i->second( reinterpret_cast<const char*>(map->data + offset), static_cast<std::size_t>(size) );
+        else        obj = i->second( detached.data(), detached.size() );
+
+        if(!obj)
+            throw Error( "Unable to load stored object of type '" + tag + "'" );
+        return obj;
+    }
+
+    bool StoredObject::isLoaded() const
+    {
+        std::lock_guard<std::mutex> lock(objectMutex);
+        return obj != nullptr;
+    }
+
+    bool StoredObject::getLocation(std::int64_t& outOffset, std::int64_t& outSize) const
+    {
+        std::lock_guard<std::mutex> lock(objectMutex);
+        if(offset < 0)
+            return false;
+        outOffset = offset;
+        outSize = size;
+        return true;
+    }
+
+    bool StoredObject::isInSidecar() const
+    {
+        std::lock_guard<std::mutex> lock(objectMutex);
+        return offset >= 0;
+    }
+
+    std::string StoredObject::getBytes() const
+    {
+        std::lock_guard<std::mutex> lock(objectMutex);
+        if(obj)         return obj->saveToBinary();
+        if(map && !map->data)
+            throw Error( "Unable to save stored object:  its object file could not be read" );
+        if(map)         return std::string( reinterpret_cast<const char*>(map->data + offset), static_cast<std::size_t>(size) );
+        return detached;
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //////////////////////////////////////////////////////////////////
+
+    std::unordered_map<std::string, ObjectSidecar::Loader>& ObjectSidecar::loaders()
+    {
+        static std::unordered_map<std::string, Loader>  lst;
+        return lst;
+    }
+
+    void ObjectSidecar::registerLoader(const std::string& tag, Loader loader)
+    {
+        loaders()[tag] = loader;
+    }
+
+    void ObjectSidecar::close()
+    {
+        if(current)
+        {
+            current->release();
+            current.reset();
+        }
+    }
+
+    void ObjectSidecar::open(const QString& filename, std::int64_t saveId)
+    {
+        //  A new sidecar left over from a full save (see objectsidecar.h).  If the project file was
+        //    written, the save just didn't get to swap it in.  Otherwise the save failed, and it's junk.
+        QString pending = filename + ".new";
+        if(QFile::exists(pending))
+        {
+            if(readSaveId(pending) == saveId)
+            {
+                QFile::remove(filename);
+                if(!QFile::rename(pending, filename))
+                {
+                    Log::wrn( "Unable to replace object file '" + filename + "' with '" + pending + "'.  Using it where it is." );
+                    openFile(pending, saveId);
+                    return;
+                }
+            }
+            else
+                QFile::remove(pending);
+        }
+
+        openFile(filename, saveId);
+    }
+
+    void ObjectSidecar::openFile(const QString& filename, std::int64_t saveId)
+    {
+        close();
+
+        auto m = std::make_shared<SidecarMapping>();
+        m->file.setFileName(filename);
+        if(!m->file.exists())
+            return;
+
+        if(!m->file.open(QIODevice::ReadOnly))
+        {
+            Log::wrn( "Unable to open object file '" + filename + "'.  Objects stored in the project will not be available." );
+            return;
+        }
+
+        m->size = m->file.size();
+        if(m->size >= headerSize)
+            m->data = m->file.map(0, m->size);
+
+        if(!m->data || std::memcmp(m->data, sidecarSignature, sizeof(sidecarSignature)) || getLE(m->data + 8, 4) != sidecarVersion)
+        {
+            Log::wrn( "Object file '" + filename + "' is not a valid object file and was ignored." );
+            return;
+        }
+        if(static_cast<std::int64_t>(getLE(m->data + 12, 8)) != saveId)
+        {
+            Log::wrn( "Object file '" + filename + "' does not belong to this project file and was ignored." );
+            return;
+        }
+
+        current = std::move(m);
+    }
+
+    StoredObject::Ptr ObjectSidecar::reference(const std::string& tag, std::int64_t offset, std::int64_t size)
+    {
+        if(!current)
+            return nullptr;
+
+        //  Make sure the reference is to the start of a record with the same tag
+        std::int64_t recstart = offset - 8 - static_cast<std::int64_t>(tag.size()) - 4;
+        if( tag.empty() || size < 0 || recstart < headerSize || offset + size > current->size )
+            return nullptr;
+
+        auto p = current->data + recstart;
+        if( getLE(p, 4) != tag.size() || std::memcmp(p + 4, tag.data(), tag.size()) || getLE(p + 4 + tag.size(), 8) != static_cast<std::uint64_t>(size) )
+            return nullptr;
+
+        auto out = std::make_shared<StoredObject>();
+        out->tag = tag;
+        out->map = current;
+        out->offset = offset;
+        out->size = size;
+        current->users.push_back(out);
+        return out;
+    }
+
+    void ObjectSidecar::rewrite(const QString& filename, std::int64_t saveId, const std::vector<StoredObject::Ptr>& objects)
+    {
+        abortRewrite();             // there shouldn't be one, but a stale one can't be committed along with this one
+
+        //  A new file whose commit failed is still in use where it was written.  It has to be moved out
+        //    of the way before it can be written again.
+        QString newname = filename + ".new";
+        if(current && current->file.fileName() == newname && !current->moveTo(filename))
+            throw Error( "Unable to replace object file '" + filename + "'" );
+
+        finalName = filename;
+
+        if(objects.empty())
+        {
+            close();                // the old file is only removed on commit
+            return;
+        }
+
+        //  Objects which were never loaded are copied straight out of the existing sidecar, which stays
+        //    where it is (see objectsidecar.h)
+        QFile file(newname);
+        if( !file.open( QIODevice::Truncate | QIODevice::WriteOnly ) )
+        {
+            finalName.clear();
+            throw Error( "Unable to open file '" + newname + "' for writing" );
+        }
+        pendingName = newname;
+
+        auto hdr = makeHeader(saveId);
+        file.write(hdr.data(), hdr.size());
+        std::int64_t pos = headerSize;
+
+        std::unordered_map<StoredObject*, std::int64_t>     written;        // the same object may be in several keys
+        try
+        {
+            for(auto& i : objects)
+            {
+                if(!written.count(i.get()))
+                    written[i.get()] = writeRecord(file, pos, i->tag, i->getBytes());
+            }
+            if(!file.flush())
+                throw Error( "Error writing to object file '" + newname + "':  " + file.errorString() );
+        }
+        catch(...)
+        {
+            file.close();
+            abortRewrite();
+            throw;
+        }
+        file.close();
+
+        //  Switch to the new file
+        close();
+        openFile(newname, saveId);
+
+        std::lock_guard<std::mutex> lock(objectMutex);
+        for(auto& i : written)
+        {
+            auto& obj = *i.first;
+            obj.detached.clear();
+            obj.offset = i.second;
+            if(obj.obj)                 obj.map.reset();
+            else if(current)            obj.map = current;
+        }
+        if(current)
+        {
+            for(auto& i : objects)
+                current->users.push_back(i);
+        }
+    }
+
+    void ObjectSidecar::commitRewrite()
+    {
+        if(finalName.isEmpty())
+            return;
+
+        QString filename = std::move(finalName);
+        QString newname = std::move(pendingName);
+        finalName.clear();
+        pendingName.clear();
+
+        bool moved;
+        if(newname.isEmpty())
+            moved = !QFile::exists(filename) || QFile::remove(filename);
+        else if(current)
+            moved = current->moveTo(filename);
+        else
+        {
+            QFile::remove(filename);
+            moved = QFile::rename(newname, filename);
+        }
+
+        if(!moved)
+            throw Error( "Unable to replace object file '" + filename + "'" );
+    }
+
+    void ObjectSidecar::abortRewrite()
+    {
+        if(finalName.isEmpty())
+            return;
+
+        //  Everything in the new file gets its own copy of its bytes (as if it had never been saved),
+        //    and the old file was never touched
+        if(!pendingName.isEmpty())
+        {
+            if(current && current->file.fileName() == pendingName)
+                close();
+            QFile::remove(pendingName);
+        }
+        finalName.clear();
+        pendingName.clear();
+    }
+
+    void ObjectSidecar::append(const QString& filename, std::int64_t saveId, const std::vector<StoredObject::Ptr>& objects)
+    {
+        //  Anything which was loaded may have been modified since it was written, so it gets written again
+        std::vector<StoredObject::Ptr> toWrite;
+        for(auto& i : objects)
+        {
+            if(i->isStorable() && (!i->isInSidecar() || i->isLoaded()) && std::find(toWrite.begin(), toWrite.end(), i) == toWrite.end())
+                toWrite.push_back(i);
+        }
+        if(toWrite.empty())
+            return;
+
+        //  If there is a sidecar, but it isn't open, it was rejected as stale.  Start over.
+        QFile file(filename);
+        bool isnew = !current;
+        if( !file.open( isnew ? (QIODevice::Truncate | QIODevice::WriteOnly) : (QIODevice::WriteOnly | QIODevice::Append) ) )
+            throw Error( "Unable to open file '" + filename + "' for writing" );
+
+        std::int64_t pos = file.size();
+        if(isnew)
+        {
+            auto hdr = makeHeader(saveId);
+            file.write(hdr.data(), hdr.size());
+            pos = headerSize;
+        }
+
+        std::vector<std::int64_t> offsets;
+        for(auto& i : toWrite)
+            offsets.push_back( writeRecord(file, pos, i->tag, i->getBytes()) );
+
+        if(!file.flush())
+            throw Error( "Error writing to object file '" + filename + "':  " + file.errorString() );
+        file.close();
+
+        //  The new records are past the end of the current mapping, but that's fine, since everything
+        //    that was just written is either loaded or has its own copy of its bytes.
+        if(!current)
+            open(filename, saveId);
+
+        std::lock_guard<std::mutex> lock(objectMutex);
+        for(std::size_t i = 0; i < toWrite.size(); ++i)
+        {
+            toWrite[i]->offset = offsets[i];
+            if(current)
+                current->users.push_back(toWrite[i]);
+        }
+    }
+
+    std::int64_t ObjectSidecar::deadBytes(const std::vector<StoredObject::Ptr>& objects) const
+    {
+        if(!current)
+            return 0;
+
+        QFileInfo info( current->file.fileName() );
+        std::int64_t live = headerSize;
+        std::set<const StoredObject*> counted;
+        for(auto& i : objects)
+        {
+            std::int64_t at, size;
+            if(i && i->getLocation(at, size) && counted.insert(i.get()).second)
+                live += 4 + static_cast<std::int64_t>(i->tag.size()) + 8 + size;
+        }
+        return std::max<std::int64_t>(0, info.size() - live);
+    }
+}
@@ -0,0 +1,118 @@
+#ifndef LUSCH_CORE_OBJECTSIDECAR_H_INCLUDED
+#define LUSCH_CORE_OBJECTSIDECAR_H_INCLUDED
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <QString>
+#include "lua/objects/lua_object.h"
+
+/*
+    Object values (ProjectData::Type::Obj) are not stored in the project's json.  They are stored in a
+    binary 'sidecar' file next to the project file (<project>.bin), and the json only has a reference
+    to them:
+
+            {"$obj": "<storage tag>", "at": <offset of the data in the sidecar>, "size": <bytes>}
+
+    When a project is loaded, the sidecar is memory mapped, and objects are not built until something
+    actually asks for them (ie, lsh.get).  So objects that are never touched never cost anything more
+    than the mapping.
+
+    Sidecar file layout:
+        - 8 byte signature, 4 byte version, 8 byte save id (little endian)
+        - any number of records:  4 byte tag length, tag, 8 byte data size, data
+
+    The save id is the same one the journal uses (see project_journal.cpp).  A sidecar which doesn't
+    match the project file is ignored.
+
+    A full save rewrites the sidecar before the project file, since the project file refers to the new
+    offsets.  So the new sidecar is written next to the old one (<project>.bin.new), and only replaces it
+    once the project file has been written (commitRewrite).  If the project file can't be written,
+    abortRewrite throws the new one away, and the old project file and sidecar are still a matching
+    pair.  If the program dies in between, the next open sees the new sidecar's save id matches the
+    project file, and finishes the swap.
+
+    Objects can only be stored if their class has a storage tag (see LuaObject::getStorageTag), and
+    has registered a loader for that tag with ObjectSidecar::registerLoader.  Objects which can't be
+    stored are simply not saved, same as before the sidecar existed.
+
+    StoredObject is what ProjectData actually holds for object values.  It is a handle which is either
+    the loaded object, or a location in the sidecar to load it from (or both).
+ */
+
+namespace lsh
+{
+    class SidecarMapping;
+
+    class StoredObject
+    {
+    public:
+        typedef std::shared_ptr<StoredObject>       Ptr;
+
+        static Ptr          fromObject(const LuaObject::Ptr& obj);
+
+        LuaObject::Ptr      get() const;                    // loads the object if it hasn't been yet
+        bool                isLoaded() const;
+        bool                isStorable() const              { return !tag.empty();              }
+        const std::string&  getTag() const                  { return tag;                       }
+
+        // Where the object is in the current sidecar file.  Saves move objects (on the main thread), so
+        //   the offset and size are read together -- returns false if it isn't in the file.
+        bool                getLocation(std::int64_t& offset, std::int64_t& size) const;
+        bool                isInSidecar() const;
+
+    private:
+        friend class ObjectSidecar;
+        friend class SidecarMapping;
+
+        std::string                         tag;
+        mutable LuaObject::Ptr              obj;
+        std::shared_ptr<SidecarMapping>     map;            // where to load 'obj' from, if it isn't loaded
+        std::string                         detached;       // ... or its bytes, if the mapping had to be released
+        std::int64_t                        offset = -1;    // location in the current sidecar file (-1 if not in it)
+        std::int64_t                        size = 0;
+
+        std::string         getBytes() const;
+    };
+
+    class ObjectSidecar
+    {
+    public:
+        typedef LuaObject::Ptr (*Loader)(const char* data, std::size_t size);
+        static void             registerLoader(const std::string& tag, Loader loader);
+
+        void                    open(const QString& filename, std::int64_t saveId);      // map an existing sidecar (does nothing if there isn't one)
+        void                    close();
+
+        // Get an object from the currently open sidecar (ie, from a json reference).  Returns null if the reference is bad.
+        StoredObject::Ptr       reference(const std::string& tag, std::int64_t offset, std::int64_t size);
+
+        // Full save:  write a new sidecar containing only 'objects' and switch to it.  Every object gets a new offset.
+        //   The old file stays where it is until commitRewrite, once the project file is written (see above).
+        void                    rewrite(const QString& filename, std::int64_t saveId, const std::vector<StoredObject::Ptr>& objects);
+        void                    commitRewrite();        // throws if the new file couldn't be moved in place.  The next open will still find it
+        void                    abortRewrite();
+
+        // Journal save:  add whichever of 'objects' aren't already in the sidecar to the end of it.
+        void                    append(const QString& filename, std::int64_t saveId, const std::vector<StoredObject::Ptr>& objects);
+
+        // Bytes of the current sidecar that none of 'objects' use (ie, old copies left behind by journal saves).
+        //   Only a rewrite gets them back.
+        std::int64_t            deadBytes(const std::vector<StoredObject::Ptr>& objects) const;
+
+    private:
+        std::shared_ptr<SidecarMapping>     current;
+
+        //  A rewrite that hasn't been committed yet
+        QString                             pendingName;        // the new file.  Empty if the sidecar is just to be removed
+        QString                             finalName;          // where it goes.  Empty if there's no rewrite pending
+
+        void                    openFile(const QString& filename, std::int64_t saveId);
+
+        static std::unordered_map<std::string, Loader>&     loaders();
+        friend class StoredObject;
+    };
+}
+
+#endif
@@ -32,13 +32,17 @@ namespace lsh
         return out;
     }
     
-    void ProgramSettings::fromJson(const json::object& obj)
+    void ProgramSettings::fromJson(const json::object& obj)         { readJson(obj);    }
+    void ProgramSettings::fromJson(const json::doc::object& obj)    { readJson(obj);    }
+
+    template <typename Object>
+    void ProgramSettings::readJson(const Object& obj)
     {
         ///////////////////////////////////////
         //  Check the header
         bool ok = true;
 
-        ok = ok && json::readField<json::object>(obj, "header", [&](const json::object& blk) {
+        ok = ok && json::readField<Object>(obj, "header", [&](const Object& blk) {
             ok = ok && json::readField<std::string>(blk, "filetype", [&](const std::string& v){ ok = (v == settingsFileHeaderString);   });
             ok = ok && json::readField<std::string>(blk, "version",  [&](const std::string& v){ ok = (v == settingsFileVersion);        });
         });
@@ -48,14 +52,14 @@ namespace lsh
 
         ///////////////////////////////////////
         //  "directories" section
-        json::readField<json::object>(obj, "directories", [&](const json::object& blk) {
+        json::readField<Object>(obj, "directories", [&](const Object& blk) {
             json::readField<std::string>(blk, "blueprint", [&](const std::string& v)    {  blueprintDir.set(v,"");              });
             json::readField<std::string>(blk, "lastProject", [&](const std::string& v)  {  lastProjectDir.set(v,"");            });
         });
 
         ///////////////////////////////////////
         //  "mainwindow" section
-        json::readField<json::object>(obj, "mainwindow", [&](const json::object& blk) {
+        json::readField<Object>(obj, "mainwindow", [&](const Object& blk) {
             json::readField<std::string>(blk, "geometry", [&](const std::string& v) {   mainWindowGeometry = QByteArray::fromStdString(v);  });
             json::readField<std::string>(blk, "state",    [&](const std::string& v) {   mainWindowState = QByteArray::fromStdString(v);     });
         });
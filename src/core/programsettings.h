@@ -19,6 +19,10 @@ namespace lsh
 
         json::object        toJson() const;
         void                fromJson(const json::object& obj);
+        void                fromJson(const json::doc::object& obj);     // same, read from a json::doc::document
+
+    private:
+        template <typename Object> void     readJson(const Object& obj);
     };
 }
 
@@ -1,5 +1,8 @@
 
+#include <atomic>
 #include <QDir>
+#include <QFile>
+#include <QFileInfo>
 #include <QMessageBox>
 #include "lua/lua_wrapper.h"
 #include "lua/lua_stacksaver.h"
@@ -12,6 +15,7 @@
 #include "log.h"
 #include "util/safecall.h"
 #include "versioninfo.h"
+#include "util/jsonstreamwriter.h"
 
 namespace lsh
 {
@@ -25,25 +29,70 @@ namespace lsh
             LuaFunction::addBounded<Project>("io.open", &Project::lua_openFile);
             LuaFunction::addBounded<Project>("lsh.get", &Project::lua_getData);
             LuaFunction::addBounded<Project>("lsh.set", &Project::lua_setData);
+            LuaFunction::addBounded<Project>("lsh.query", &Project::lua_query);
         }
+
+        connect( this, &Project::saveThreadDone, this, &Project::finishSave, Qt::QueuedConnection );
+        connect( this, &Project::prefetchThreadDone, this, &Project::prefetchSignalled, Qt::QueuedConnection );
+        connect( &autosaveTimer, &QTimer::timeout, this, &Project::autosave );
+    }
+
+    Project::~Project()
+    {
+        waitForSave();
+        finishAutosave();
+        finishPrefetch();
     }
     
     Project& Project::operator = (Project&& rhs)
     {
+        waitForSave();
+        rhs.waitForSave();
+        finishAutosave();
+        rhs.finishAutosave();
+        finishPrefetch();
+        rhs.finishPrefetch();
+
         moveBindings(rhs);
         blueprint =             std::move(rhs.blueprint);
         projectFileName =       std::move(rhs.projectFileName);
         bpFileName =            std::move(rhs.bpFileName);
         fileInfoIndexes =       std::move(rhs.fileInfoIndexes);
+        romImages.clear();
+        romImages =             std::move(rhs.romImages);
+        resolvedFiles =         std::move(rhs.resolvedFiles);
+        unreadableFiles =       std::move(rhs.unreadableFiles);
+        verifiedFiles =         std::move(rhs.verifiedFiles);
         dat =                   std::move(rhs.dat);
+        undoStack =             std::move(rhs.undoStack);
+        redoStack =             std::move(rhs.redoStack);
+        savedData =             std::move(rhs.savedData);
+        sectionTracker =        std::move(rhs.sectionTracker);
+        indexes =               std::move(rhs.indexes);
         loaded =                rhs.loaded;
         dirty =                 rhs.dirty;
         savePretty =            rhs.savePretty;
         saveAsTree =            rhs.saveAsTree;
+        useJournal =            rhs.useJournal;
+        saveBinary =            rhs.saveBinary;
+        compressLevel =         rhs.compressLevel;
+        autosaveSeconds =       rhs.autosaveSeconds;
+        autosaveKeys =          std::move(rhs.autosaveKeys);
+        unsavedKeys =           std::move(rhs.unsavedKeys);
+        saveId =                rhs.saveId;
+        fullSaveNeeded =        rhs.fullSaveNeeded;
+        fullSaveRequested =     rhs.fullSaveRequested;
+        changeCount =           rhs.changeCount;
+        lastSaveWorked =        rhs.lastSaveWorked;
+        sidecar =               std::move(rhs.sidecar);
+
+        publishSnapshot();
 
         // TODO - need to emit a signal that causes all project data ties to be rebound.
 
         rhs.loaded = rhs.dirty = false;
+        rhs.autosaveTimer.stop();
+        startAutosaveTimer();
         return *this;
     }
 
@@ -64,6 +113,8 @@ namespace lsh
         lua_setfield(lua, -2, "get");
         LuaFunction::pushBounded<Project>(lua, "lsh.set");
         lua_setfield(lua, -2, "set");
+        LuaFunction::pushBounded<Project>(lua, "lsh.query");
+        lua_setfield(lua, -2, "query");
         lua_pop(lua, 1);                // drop the "lsh" table
     }
 
@@ -93,16 +144,280 @@ namespace lsh
         FileFlags flgs;
         if(!flgs.fromStringMode(mode))              throw Error("Invalid mode string '" + mode + "' passed to io.open");
 
-        bool waswritable;
-        auto filename = translateFileName(name, waswritable);
+        auto file = translateFileName(name);
+        auto& item = blueprint.files[file.index];
+
+        if(flgs.write && !item.writable)            throw Error("File '" + name + "' is marked in the project as read-only and cannot be opened for writing.");
+
+        //  Files (not directories) in binary mode are opened as images (see romimagecache.h)
+        if(flgs.binary && name.find('/') == name.npos)
+        {
+            auto mode = flgs.trunc ?    RomImageCache::Mode::Truncate :
+                        flgs.append ?   RomImageCache::Mode::Create :
+                                        RomImageCache::Mode::Existing;
+
+            //  Patches are opened as the file they're a patch of, with the patch applied
+            RomImageCache::Ptr base;
+            if(!item.patchOf.empty())
+            {
+                if(item.fileName.isEmpty())     // an optional patch that wasn't given
+                {
+                    if(mustopen)    throw Error("File '" + name + "' has not been chosen for this project");
+                    lua_pushnil(lua);
+                    return 1;
+                }
+
+                base = romImages.open( item.patchOf, QString::fromStdString(translateFileName(item.patchOf).path), RomImageCache::Mode::Existing );
+                if(!base)           throw Error("File '" + name + "' is a patch of '" + item.patchOf + "', which could not be opened");
+            }
 
-        if(flgs.write && !waswritable)              throw Error("File '" + name + "' is marked in the project as read-only and cannot be opened for writing.");
+            auto image = romImages.open( name, QString::fromStdString(file.path), mode, base );
+            if(image)               return LuaIOFile::openForLua(lua, image, flgs);
+            else if(mustopen)       throw Error("Unable to open file '" + file.path + "'");
 
-        return LuaIOFile::openForLua(lua, filename.getFullPath(true), flgs, mustopen);
+            lua_pushnil(lua);
+            return 1;
+        }
+
+        return LuaIOFile::openForLua(lua, file.path, flgs, mustopen);
     }
     
-    FileName Project::translateFileName(const std::string& givenname, bool& waswritable)
+    //////////////////////////////////////////////////////////////////
+    //  Prefetch
+
+    struct Project::PrefetchJob
+    {
+        struct File
+        {
+            std::string     id;
+            QString         path;
+            bool            required = false;       // an input, which has to be there
+            QString         error;                  // if it couldn't be read
+            bool            cached = false;         // if 'data' has the whole file
+            QByteArray      data;
+            qint64          size = -1;
+            QDateTime       modified;
+            QDateTime       checked;                // when 'size' and 'modified' were noted
+            RomFingerprint  expected;               // from the blueprint
+            bool            skipInesHeader = false;
+            RomFingerprint  actual;                 // if 'expected' isn't empty
+        };
+        std::vector<File>   files;
+        std::atomic<bool>   done{false};            // set by the thread once it's finished with the job
+        std::atomic<bool>   cancelled{false};       // the files changed.  Stop, and throw away what was found
+    };
+
+    namespace
+    {
+        const qint64    maxPrefetchSize = 64 * 1024 * 1024;     // bigger files are only checked and fingerprinted, not kept
+
+        //  Fingerprints a file from where it is, without holding all of it.  Sets 'error' if it can't be read.
+        RomFingerprint fingerprintFile(QFile& file, const RomFingerprint& expected, bool skipInesHeader, QString& error)
+        {
+            auto out = RomFingerprint::compute(file, expected, skipInesHeader);
+            if(out.size < 0)
+                error = file.errorString();
+            return out;
+        }
+    }
+
+    void Project::startPrefetch()
+    {
+        if(prefetchJob)
+            prefetchJob->cancelled = true;
+        finishPrefetch();
+
+        //  Every file a script will surely open.  Patches aren't read as they are, so they're left
+        //    for when they're opened.  Writable files don't have to exist yet.
+        auto job = std::make_shared<PrefetchJob>();
+        for(auto& i : blueprint.files)
+        {
+            if(i.directory || i.optional || !i.patchOf.empty() || i.fileName.isEmpty())
+                continue;
+
+            PrefetchJob::File f;
+            f.id =          i.id;
+            f.path =        QString::fromStdString( translateFileName(i.id).path );
+            f.required =    !i.writable;
+            if(f.required)
+            {
+                f.expected =        i.expected;
+                f.skipInesHeader =  i.skipInesHeader;
+            }
+            job->files.push_back( std::move(f) );
+        }
+        if(job->files.empty())
+            return;
+
+        prefetchJob = job;
+        prefetchThread = std::thread( [this, job] ()
+        {
+            prefetchFiles(*job);
+            job->done = true;
+            emit prefetchThreadDone();      // prefetchSignalled, back on the main thread
+        });
+    }
+
+    //  Runs on the prefetch thread.  Touches nothing but the job.
+    void Project::prefetchFiles(PrefetchJob& job)
     {
+        for(auto& f : job.files)
+        {
+            if(job.cancelled)
+                return;
+
+            f.checked = QDateTime::currentDateTime();
+            QFileInfo info(f.path);
+            if(!info.exists())
+            {
+                if(f.required)      f.error = "The file does not exist";
+                continue;
+            }
+
+            //  The size and time are from before it's read, so if it changes while being read, the
+            //    cache just reads it again
+            f.size =        info.size();
+            f.modified =    info.lastModified();
+
+            QFile file(f.path);
+            if(!file.open(QIODevice::ReadOnly))
+            {
+                if(f.required)      f.error = file.errorString();
+                continue;
+            }
+            if(f.size > maxPrefetchSize)
+            {
+                if(!f.expected.empty())
+                    f.actual = fingerprintFile(file, f.expected, f.skipInesHeader, f.error);
+                continue;
+            }
+
+            f.data = file.readAll();
+            f.cached = (f.data.size() == f.size);
+            if(f.cached && !f.expected.empty())
+                f.actual = RomFingerprint::compute(f.data, f.expected, f.skipInesHeader);
+        }
+    }
+
+    //  The signal can arrive after its job was already finished some other way, and another prefetch
+    //    has started since.  That one isn't waited for here -- it will send its own signal.
+    void Project::prefetchSignalled()
+    {
+        if(prefetchJob && prefetchJob->done)
+            finishPrefetch();
+    }
+
+    void Project::finishPrefetch()
+    {
+        if(!prefetchJob)
+            return;                 // already finished
+
+        prefetchThread.join();
+        auto job = std::move(prefetchJob);
+        prefetchJob.reset();
+        if(job->cancelled)
+            return;                 // it was looking at the old files
+
+        for(auto& f : job->files)
+        {
+            if(!f.error.isEmpty())
+            {
+                Log::err( "Required file '" + f.path + "' can't be read:  " + f.error );
+                unreadableFiles.push_back(f.id);
+            }
+            else
+            {
+                if(f.cached)
+                    romImages.preload(f.id, f.path, f.data, f.size, f.modified, f.checked);
+                if(!f.expected.empty() && f.actual.size >= 0)
+                {
+                    auto mismatch = f.expected.mismatch(f.actual);
+                    if(mismatch.empty())    verifiedFiles[f.id] = { f.size, f.modified };
+                    else                    Log::wrn( "File '" + f.path + "' doesn't match the blueprint:  " + QString::fromStdString(mismatch) );
+                }
+            }
+        }
+    }
+
+    //  Stops an import or export before it starts, if a required file the prefetch couldn't read
+    //    still can't be read, or if an input doesn't match the fingerprint the blueprint gives for it.
+    //    Files the prefetch already verified are only checked again if they've changed since.
+    void Project::checkRequiredFiles()
+    {
+        finishPrefetch();
+
+        std::string missing;
+        for(auto& id : unreadableFiles)
+        {
+            QFileInfo info( QString::fromStdString(translateFileName(id).path) );
+            if(!info.exists() || !info.isReadable())
+                missing += (missing.empty() ? "'" : ", '") + id + "'";
+        }
+        if(!missing.empty())
+            throw Error( "Required files can't be read:  " + missing + ".  Check the project's files." );
+        unreadableFiles.clear();
+
+        std::string mismatched;
+        for(auto& i : blueprint.files)
+        {
+            if(i.expected.empty() || i.directory || i.writable || !i.patchOf.empty() || i.fileName.isEmpty())
+                continue;
+
+            auto path = QString::fromStdString( translateFileName(i.id).path );
+            QFileInfo info(path);
+            if(!info.exists())
+                continue;           // opening it will say so, if it's needed
+
+            auto verified = verifiedFiles.find(i.id);
+            if(verified != verifiedFiles.end() && verified->second.size == info.size() && verified->second.modified == info.lastModified())
+                continue;
+
+            QFile file(path);
+            if(!file.open(QIODevice::ReadOnly))
+                continue;
+            QString error;
+            auto actual = fingerprintFile(file, i.expected, i.skipInesHeader, error);
+            if(!error.isEmpty())
+                continue;           // same as not being able to open it
+            auto mismatch = i.expected.mismatch(actual);
+            if(mismatch.empty())
+                verifiedFiles[i.id] = { info.size(), info.lastModified() };
+            else
+                mismatched += (mismatched.empty() ? "'" : "; '") + i.id + "' (" + mismatch + ")";
+        }
+        if(!mismatched.empty())
+            throw Error( "Files don't match the blueprint:  " + mismatched + ".  Check the project's files." );
+    }
+
+    //  The prefetch starts over on the new files, so they're verified in the background before the
+    //    next import or export needs them
+    void Project::setFileName(std::size_t index, const FileName& name)
+    {
+        auto& file = blueprint.files.at(index);
+        if(file.fileName.getFullPath() == name.getFullPath())
+            return;
+
+        file.fileName = name;
+        filesChanged();
+        if(loaded)
+            startPrefetch();
+    }
+
+    //  Anything known about the old files is wrong now.  A new destination never got any of the
+    //    sections, so the next export has to write all of them.
+    void Project::filesChanged()
+    {
+        resolvedFiles.clear();
+        verifiedFiles.clear();
+        sectionTracker.markAllDirty();
+    }
+
+    Project::ResolvedFile Project::translateFileName(const std::string& givenname)
+    {
+        auto cached = resolvedFiles.find(givenname);
+        if(cached != resolvedFiles.end())
+            return cached->second;
+
         // If there's a '/' in the given name, everything left of the / is a directory ID
         // Otherwise, the whole thing is a file ID
 
@@ -136,8 +451,14 @@ namespace lsh
             out.makeAbsoluteWith( base );
         }
 
-        waswritable = item.writable;
-        return out;
+        //  Scripts that go through every file in a directory could fill this up forever
+        if(resolvedFiles.size() >= maxResolvedFiles)
+            resolvedFiles.clear();
+
+        auto& entry = resolvedFiles[givenname];
+        entry.path =    out.getFullPath(true);
+        entry.index =   itemIndex->second;
+        return entry;
     }
 
     int Project::lua_setData(Lua& lua)
@@ -148,18 +469,15 @@ namespace lsh
         if(lua_type(lua, 1) != LUA_TSTRING)     throw Error("lsh.set:  Parameter 1 must be a string");
         auto name = lua.toString(1);
         
-        auto& item = dat[name];
-
-        connect(&item, &ProjectData::dataChanged, this, &Project::dirtyByData, Qt::ConnectionType(Qt::DirectConnection | Qt::UniqueConnection) );
-
+        ProjectData item;
 
         switch( lua_type(lua, 2) )
         {
         case LUA_TNIL:          item.setNull();                         break;
         case LUA_TSTRING:       item.set( lua.toString(2) );            break;
         case LUA_TNUMBER:
-            if(lua_isinteger(lua,2))    item.set( lua_tointeger(lua, 2) );
-            else                        item.set( lua_tonumber (lua, 2) );
+            if(lua_isinteger(lua,2))    item.set( static_cast<ProjectData::int_t>(lua_tointeger(lua, 2)) );
+            else                        item.set( static_cast<double>(lua_tonumber(lua, 2)) );
             break;
         case LUA_TBOOLEAN:      item.set( !!lua_toboolean(lua,2) );     break;
 
@@ -171,6 +489,7 @@ namespace lsh
             throw Error(std::string("Unsupported type (") + lua_typename(lua,2) + ") passed to lsh.set");
         }
 
+        setData(name, item);
         return 0;
     }
 
@@ -182,14 +501,15 @@ namespace lsh
         if(lua_type(lua, 1) != LUA_TSTRING)     throw Error("lsh.get:  Parameter 1 must be a string");
         auto name = lua.toString(1);
 
-        auto i = dat.find(name);
-        if(i == dat.end())          // not found, just return nil
+        sectionTracker.keyRead(name);
+        auto found = dat.find(name);
+        if(!found)                  // not found, just return nil
         {
             lua_pushnil(lua);
             return 1;
         }
 
-        auto& item = i->second;
+        auto& item = *found;
 
         switch(item.getType())
         {
@@ -204,77 +524,154 @@ namespace lsh
 
         return 1;
     }
-    //////////////////////////////////////////////////////////////////
-    //////////////////////////////////////////////////////////////////
-    //////////////////////////////////////////////////////////////////
 
-    namespace
+    //  lsh.query(pattern [, op, value])
+    //    Returns an array of every key matching 'pattern' whose value compares to 'value' with 'op' (one of
+    //    ==, <, <=, >, >=), ordered by value.  With no op, every matching key is returned.
+    int Project::lua_query(Lua& lua)
     {
-        json::value& findTargetJsonObjectInTree(json::object& obj, std::string& name, const std::string& fullname)
+        lua.checkTooFewParams(1,"lsh.query");
+        lua.checkTooManyParams(3,"lsh.query");
+
+        if(lua_type(lua, 1) != LUA_TSTRING)     throw Error("lsh.query:  Parameter 1 must be a string");
+        auto pattern = lua.toString(1);
+
+        std::string op;
+        ProjectData value;
+        if(lua_gettop(lua) >= 2)
         {
-            auto pos = name.find('.');
-            if(pos == name.npos)
-            {
-                auto& field = obj[name];
-                if(!field.is<json::null>())
-                {
-                    throw Error("Error when attempting to save project file!  When serializing '" + fullname + "', data with the name '" + name + "' already exists (possibly as a tree)!  To save the project, disable 'Save as Tree' option in the project settings and try again.");
-                }
+            lua.checkTooFewParams(3,"lsh.query");
+            if(lua_type(lua, 2) != LUA_TSTRING) throw Error("lsh.query:  Parameter 2 must be a string");
+            op = lua.toString(2);
 
-                return field;
-            }
-            else
+            switch( lua_type(lua, 3) )
             {
-                auto fieldname = name.substr(0, pos);
-                name = name.substr(pos+1);
-
-                auto& field = obj[fieldname];
-                if(field.is<json::null>())      field = json::value(json::object());
+            case LUA_TSTRING:       value.set( lua.toString(3) );           break;
+            case LUA_TNUMBER:
+                if(lua_isinteger(lua,3))    value.set( static_cast<ProjectData::int_t>(lua_tointeger(lua, 3)) );
+                else                        value.set( static_cast<double>(lua_tonumber(lua, 3)) );
+                break;
+            case LUA_TBOOLEAN:      value.set( !!lua_toboolean(lua,3) );    break;
+            default:
+                throw Error(std::string("lsh.query:  Unsupported type (") + lua_typename(lua,3) + ") for parameter 3");
+            }
+        }
 
-                if(!field.is<json::object>())
-                {
-                    if(!field.is<json::null>())
-                    {
-                        throw Error("Error when attempting to save project file!  When serializing '" + fullname + "', data with the name '" + fieldname + "' already exists!  To save the project, disable 'Save as Tree' option in the project settings and try again.");
-                    }
+        auto& index = getIndex(pattern);
+        sectionTracker.patternRead(pattern);
+        std::vector<ValueIndex::Result> results;
+
+        if     (op.empty())     results = index.query(nullptr, false, nullptr, false);
+        else if(op == "==")     results = index.query(&value, true, &value, true);
+        else if(op == "<")      results = index.query(nullptr, false, &value, false);
+        else if(op == "<=")     results = index.query(nullptr, false, &value, true);
+        else if(op == ">")      results = index.query(&value, false, nullptr, false);
+        else if(op == ">=")     results = index.query(&value, true, nullptr, false);
+        else                    throw Error("lsh.query:  Unknown comparison '" + op + "'.  Must be one of:  == < <= > >=");
+
+        lua_createtable(lua, static_cast<int>(results.size()), 0);
+        lua_Integer n = 0;
+        for(auto& i : results)
+        {
+            sectionTracker.keyRead(i.first);        // for ownership.  Changes to any key the pattern matches are caught by patternRead
+            lua.pushString(i.first);
+            lua_seti(lua, -2, ++n);
+        }
 
-                    field = json::value( json::object() );
-                }
+        return 1;
+    }
+    //////////////////////////////////////////////////////////////////
+    //////////////////////////////////////////////////////////////////
+    //////////////////////////////////////////////////////////////////
 
-                return findTargetJsonObjectInTree(field.get<json::object>(), name, fullname);
+    namespace
+    {
+        void writeDataValue(JsonStreamWriter& out, const ProjectData& v)
+        {
+            switch(v.getType())
+            {
+            case ProjectData::Type::Bool:   out.value( v.asBool() );            break;
+            case ProjectData::Type::Int:    out.value( v.asInt() );             break;
+            case ProjectData::Type::Dbl:    out.value( v.asDbl() );             break;
+            case ProjectData::Type::Str:    out.value( v.asString() );          break;
+            default:                        out.value( v.toJson() );            break;
             }
         }
     }
 
-    json::object Project::dataToJson() const
+    //  In tree mode, each '.' in a key is a level of nesting:  "a.b.c" is written as {"a":{"b":{"c":...}}}.
+    //
+    //  Keys come out of the store in tree order (see DataStore::keyLess), so this is done in a single pass:
+    //    whenever the part of the key before the last '.' changes, close the objects that no longer
+    //    match and open the new ones.  That same order puts a key immediately before any keys that
+    //    would make it a tree ("a.b" is followed by "a.b.c"), which is the only way a key can conflict.
+    void Project::writeDataJson(JsonStreamWriter& out, const DataStore& data, bool asTree)
     {
-        json::object obj;
+        out.beginObject();
 
-        if(saveAsTree)
+        if(!asTree)
         {
-            std::string name;
-
-            for(auto& i : dat)
+            for(auto& i : data)
             {
                 if(!i.second.shouldSaveToJson())
                     continue;
 
-                name = i.first;
-                auto& value = findTargetJsonObjectInTree(obj, name, i.first);
-                value = i.second.toJson();
+                out.key(i.first);
+                writeDataValue(out, i.second);
             }
         }
         else
         {
-            for(auto& i : dat)
+            std::vector<std::string>    open;           // names of the objects currently open
+            std::vector<std::size_t>    dots;           // positions of every '.' in the current key
+            const std::string*          prevKey = nullptr;
+
+            for(auto& i : data)
             {
                 if(!i.second.shouldSaveToJson())
                     continue;
-                obj[i.first] = i.second.toJson();
+                auto& key = i.first;
+
+                dots.clear();
+                for(auto p = key.find('.'); p != key.npos; p = key.find('.', p+1))
+                    dots.push_back(p);
+
+                if(prevKey && key.size() > prevKey->size() && key[prevKey->size()] == '.' && key.compare(0, prevKey->size(), *prevKey) == 0)
+                {
+                    auto fieldname = prevKey->substr( prevKey->rfind('.') + 1 );
+                    throw Error("Error when attempting to save project file!  When serializing '" + key + "', data with the name '" + fieldname + "' already exists!  To save the project, disable 'Save as Tree' option in the project settings and try again.");
+                }
+
+                //  How many of the open objects does this key still belong in?
+                std::size_t common = 0;
+                std::size_t start = 0;
+                while(common < open.size() && common < dots.size() && key.compare(start, dots[common] - start, open[common]) == 0)
+                {
+                    start = dots[common] + 1;
+                    ++common;
+                }
+
+                for(; open.size() > common; open.pop_back())
+                    out.endObject();
+
+                for(; common < dots.size(); ++common)
+                {
+                    open.push_back( key.substr(start, dots[common] - start) );
+                    out.key(open.back());
+                    out.beginObject();
+                    start = dots[common] + 1;
+                }
+
+                out.key( key.substr(start) );
+                writeDataValue(out, i.second);
+                prevKey = &key;
             }
+
+            for(; !open.empty(); open.pop_back())
+                out.endObject();
         }
 
-        return obj;
+        out.endObject();
     }
 
     
@@ -285,6 +682,7 @@ namespace lsh
     void Project::populateFileInfoIndexes()
     {
         fileInfoIndexes.clear();
+        filesChanged();
 
         auto& filelist = blueprint.files;
         auto size = filelist.size();
@@ -307,16 +705,188 @@ namespace lsh
         return false;
     }
 
+    void Project::setSaveAsBinary(bool binary)
+    {
+        if(!loaded || binary == saveBinary)
+            return;
+
+        saveBinary = binary;
+        fullSaveNeeded = true;          // the whole file has to be rewritten in the new format
+        fullSaveRequested = true;
+        makeDirty();
+    }
+
     void Project::makeDirty()
     {
+        ++changeCount;
         if(dirty)       return;
 
         dirty = true;
         emit projectStateChanged();
     }
+
+    void Project::setData(const std::string& name, const ProjectData& v)
+    {
+        auto old = dat.find(name);
+        bool changed = !old || *old != v;
+        sectionTracker.keyWritten(name, changed);
+
+        if(!changed)
+            return;                 // no change -- don't burn a new version of the tree for nothing
+
+        dat.set(name, v);
+        updateIndexes(name);
+        noteChanged(name);
+        makeDirty();
+    }
+
+    void Project::noteChanged(const std::string& key)
+    {
+        unsavedKeys.insert(key);
+        autosaveKeys.insert(key);
+        if(!undoStack.empty())
+            undoStack.back().changed.insert(key);
+
+        // any new change invalidates everything that could be redone
+        redoStack.clear();
+    }
+
+    const ValueIndex& Project::getIndex(const std::string& pattern)
+    {
+        auto i = indexes.find(pattern);
+        if(i == indexes.end())
+        {
+            i = indexes.emplace(pattern, ValueIndex(pattern)).first;
+            i->second.rebuild(dat);
+        }
+        return i->second;
+    }
+
+    void Project::updateIndexes(const std::string& key)
+    {
+        if(indexes.empty())
+            return;
+
+        auto v = dat.find(key);
+        for(auto& i : indexes)
+        {
+            if(i.second.matches(key))
+            {
+                i.second.update(key, v);
+                sectionTracker.patternChanged(i.first);     // sections that queried it could get different results now
+            }
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //  Undo / Redo
+    //
+    //  An "undo step" is a snapshot of the data taken before some operation (an import, for example).
+    //  Snapshots are just copies of the DataStore, which are cheap.
+
+    void Project::beginUndoStep()
+    {
+        UndoStep step;
+        step.data = dat;
+        undoStack.push_back( std::move(step) );
+        if(undoStack.size() > maxUndoSteps)
+            undoStack.erase(undoStack.begin());
+    }
+
+    void Project::endUndoStep()
+    {
+        if(undoStack.empty())
+            return;
+
+        // If nothing actually changed, this step is pointless.  Drop it
+        if(undoStack.back().data.isSameVersionAs(dat))
+            undoStack.pop_back();
+        else
+        {
+            publishSnapshot();
+            emit projectStateChanged();
+        }
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //  Snapshots for other threads
+    //
+    //  The DataStore itself is never shared between threads -- only nodes are, and nodes never change.
+    //  So all a reader needs is its own DataStore pointing at a root that was complete when it was
+    //  published.
+
+    void Project::publishSnapshot()
+    {
+        auto cur = std::atomic_load(&published);
+        if(cur && cur->isSameVersionAs(dat))
+            return;
+        std::atomic_store(&published, std::make_shared<const DataStore>(dat));
+    }
+
+    DataStore Project::getSnapshot() const
+    {
+        auto p = std::atomic_load(&published);
+        return p ? *p : DataStore();
+    }
+
+    //  The keys recorded with a step are exactly the keys that differ between that step and the
+    //    current data, so they move along with it from one stack to the other.
+    void Project::undo()
+    {
+        if(undoStack.empty())
+            return;
+
+        UndoStep step = std::move(undoStack.back());
+        undoStack.pop_back();
+
+        unsavedKeys.insert( step.changed.begin(), step.changed.end() );
+        autosaveKeys.insert( step.changed.begin(), step.changed.end() );
+        std::swap( dat, step.data );
+        for(auto& key : step.changed)
+            updateIndexes(key);
+        redoStack.push_back( std::move(step) );
+        sectionTracker.markAllDirty();
+        publishSnapshot();
+        dataRestored();
+    }
+
+    void Project::redo()
+    {
+        if(redoStack.empty())
+            return;
+
+        UndoStep step = std::move(redoStack.back());
+        redoStack.pop_back();
+
+        unsavedKeys.insert( step.changed.begin(), step.changed.end() );
+        autosaveKeys.insert( step.changed.begin(), step.changed.end() );
+        std::swap( dat, step.data );
+        for(auto& key : step.changed)
+            updateIndexes(key);
+        undoStack.push_back( std::move(step) );
+        sectionTracker.markAllDirty();
+        publishSnapshot();
+        dataRestored();
+    }
+
+    //  After an undo or redo, the data might be right back where it was when it was saved
+    void Project::dataRestored()
+    {
+        ++changeCount;
+        dirty = fullSaveNeeded || !dat.isSameVersionAs(savedData);
+        if(!dirty)
+            resetRecovery();                // the recovery file only has changes that were just undone
+        emit projectStateChanged();         // canUndo/canRedo changed, even if nothing else did
+    }
     
     void Project::newProject(const FileName& projectPath, const FileName& bpPathRelative, Blueprint&& bp)
     {
+        waitForSave();
+        finishAutosave();
+        finishPrefetch();
+        unreadableFiles.clear();
+        verifiedFiles.clear();
+
         projectFileName = projectPath;
         bpFileName = bpPathRelative;
 
@@ -328,102 +898,137 @@ namespace lsh
 
         bindToLua(blueprint.lua);
         populateFileInfoIndexes();
+        sectionTracker.reset( blueprint.sections.size() );
+        sidecar.close();
+        indexes.clear();
+        romImages.clear();
+        publishSnapshot();
+        savedData = dat;
+
+        loaded = true;
+        fullSaveNeeded = true;
+        autosaveKeys.clear();
+        startAutosaveTimer();
     }
 
     void Project::doImport()
     {
         Log::inf( "--- Performing import ---" );
+
+        std::vector<int> toRun;
+        for(std::size_t i = 0; i < blueprint.sections.size(); ++i)
+            toRun.push_back( static_cast<int>(i) );
+
+        runSections(false, toRun);
+    }
+
+    void Project::doExport()
+    {
+        Log::inf( "--- Performing export ---" );
+
+        //  Only export sections whose data (or data they depend on) has changed since they were
+        //    last exported.
+        std::vector<int> toRun;
+        std::size_t exportable = 0;
+        for(std::size_t i = 0; i < blueprint.sections.size(); ++i)
+        {
+            auto& x = blueprint.sections[i];
+            if(!x.toExport || x.exportFunc.empty())
+                continue;
+
+            ++exportable;
+            if(sectionTracker.needsExport( static_cast<int>(i) ))
+                toRun.push_back( static_cast<int>(i) );
+        }
+
+        if(toRun.empty())
+        {
+            Log::inf( "Nothing has changed since the last export" );
+            return;
+        }
+        bool partial = toRun.size() < exportable;
+        if(partial)
+            Log::inf( "Exporting " + std::to_string(toRun.size()) + " of " + std::to_string(exportable) + " sections" );
+
+        runSections(true, toRun, partial);
+    }
+
+    void Project::runSections(bool exporting, const std::vector<int>& toRun, bool partial)
+    {
+        checkRequiredFiles();           // before anything is changed
+
         Lua& lua = blueprint.lua;
         LuaStackSaver stk(lua);
 
+        //  The entire import/export is a single undo step, even if it fails partway through.  Likewise,
+        //    whatever was written to the project's files is written to disk once, at the end.
+        beginUndoStep();
+        struct UndoGuard
+        {
+            Project* p;
+            bool     flushed;
+            ~UndoGuard() { p->sectionTracker.endSection(); p->endUndoStep(); if(!flushed) p->romImages.flush(); }
+        } undoGuard = { this, false };
+
         /////////////////////////////////////////
-        //  If there is a pre-import callback... call it
+        //  If there is a pre-import/export callback... call it
+        //    pre-export is told whether or not this is a partial export (if it is, the destination
+        //    should be updated in place rather than rebuilt)
         int paramstackpos = lua_gettop(lua) + 1;
         int params = 0;
-        if(pushCallback("pre-import"))
-            params = lua.callFunction(0,LUA_MULTRET);
+        if(pushCallback(exporting ? "pre-export" : "pre-import"))
+        {
+            int args = 0;
+            if(exporting)
+            {
+                lua_pushboolean(lua, partial);
+                args = 1;
+            }
+            params = lua.callFunction(args,LUA_MULTRET);
+        }
 
-        //  [Safe] Call each section's import function
-        for(auto& x : blueprint.sections)
+        //  [Safe] Call each section's import/export function.  Sections only count as exported once
+        //    what they wrote is on disk.
+        std::vector<int> exported;
+        for(int index : toRun)
         {
+            auto& x = blueprint.sections[index];
             LuaStackSaver loopstk(lua);
 
+            bool ok = false;
             BEGIN_SAFE
-            lua.pushGlobalFunction(x.importFunc.c_str());
+            sectionTracker.beginSection(index, exporting);
+            lua.pushGlobalFunction( (exporting ? x.exportFunc : x.importFunc).c_str() );
             for(int i = 0; i < params; ++i)
             {
                 lua_pushvalue(lua, paramstackpos+i);
             }
             lua.callFunction(params, 0);
+
+            if(exporting)
+                exported.push_back(index);
+            ok = true;
             END_SAFE
+            if(ok)      sectionTracker.endSection();
+            else        sectionTracker.sectionFailed();
         }
         
         /////////////////////////////////////
-        //  TODO - call post-import
-    }
-
-    bool Project::doSave()
-    {
-        BEGIN_SAFE
-            //////////////////////////////////////////////
-            //  Build the json value
-
-            json::value jsonData;
-            auto& mainobj = json::setNew<json::object>(jsonData);
-
-            {
-                auto& blk = json::setNew<json::object>(mainobj["header"]);
-                blk["filetype"] = json::value( projectFileHeaderString );
-                blk["version"]  = json::value( projectFileVersion      );
-            }
-            {
-                auto& blk = json::setNew<json::object>(mainobj["misc settings"]);
-                blk["savePretty"]     = json::value(savePretty);
-                blk["saveAsTree"]     = json::value(saveAsTree);
-            }
-            {
-                auto& blk = json::setNew<json::object>(mainobj["blueprint"]);
-                blk["name"] = json::value( bpFileName.getFullPath() );
-                //  TODO - record blueprint version?
-            }
-            {
-                auto& blk = json::setNew<json::object>(mainobj["files"]);
-                for(auto& x : blueprint.files)
-                {
-                    blk[x.id] = json::value( x.fileName.getFullPath() );
-                }
-            }
-            {
-                auto& blk = json::setNew<json::object>(mainobj["sections"]);
-                for(auto& x : blueprint.sections)
-                {
-                    auto& i = json::setNew<json::object>(blk[x.id]);
-                    i["toImport"] = json::value( x.toImport );
-                    i["toExport"] = json::value( x.toExport );
-                }
-            }
+        //  post-import/export gets the same parameters each section did
+        if(pushCallback(exporting ? "post-export" : "post-import"))
+        {
+            for(int i = 0; i < params; ++i)
             {
-                mainobj["data"] = json::value( dataToJson() );
+                lua_pushvalue(lua, paramstackpos+i);
             }
+            lua.callFunction(params, 0);
+        }
 
-            ///////////////////////////////////////////////////
-            //  Actually save it to the file
-
-            // TODO -- compress??
-
-            QFile file;
-            QString path = QString::fromStdString( projectFileName.getFullPath(true) );
-            file.setFileName( path );
-            if( !file.open( QIODevice::Truncate | QIODevice::WriteOnly ) )
-                throw Error( "Unable to open file '" + path + "' for writing" );
-
-            json::saveToFile(mainobj, file, savePretty);
-
-            dirty = false;                  // project is no longer dirty (we just saved it)
-            emit projectStateChanged();     // which means we also want to emit the event to indicate dirty state changed
-
-            return true;
-        END_SAFE
-        return false;
+        undoGuard.flushed = true;
+        if(!romImages.flush())
+            throw Error( "Some of the project's files could not be written (see the log).  The sections in this export will be exported again next time." );
+        for(int index : exported)
+            sectionTracker.markExported(index);
     }
-}
\ No newline at end of file
+
+}
@@ -3,11 +3,21 @@
 
 #include <stdexcept>
 #include <QString>
+#include <QTimer>
 #include <vector>
+#include <set>
+#include <map>
+#include <memory>
+#include <thread>
 #include <unordered_map>
 #include "util/qtjson.h"
 #include "lua/lua_wrapper.h"
 #include "projectdata.h"
+#include "datastore.h"
+#include "sectiontracker.h"
+#include "objectsidecar.h"
+#include "romimagecache.h"
+#include "valueindex.h"
 #include "lua/lua_binding.h"
 #include "util/filename.h"
 #include "fileinfo.h"
@@ -16,12 +26,15 @@
 
 namespace lsh
 {
+    class JsonStreamWriter;
+
     class Project : public QObject, public LuaBinding<Project>
     {
         Q_OBJECT
 
     public:
                     Project();
+                    ~Project();
                     Project(const Project&) = delete;
         Project&    operator = (const Project&) = delete;
         Project&    operator = (Project&& rhs);
@@ -29,27 +42,78 @@ namespace lsh
         bool        isDirty() const { return loaded && dirty; }
 
         void        newProject(const FileName& projectPath, const FileName& bpPathRelative, Blueprint&& bp);
+        void        openProject(const FileName& projectPath, const FileName& blueprintRoot);     // defined in project_load.cpp
+
+        //  Reads the project's files in the background, once they've been chosen, so the first import
+        //    doesn't wait on the disk.  Required files that can't be read are logged when that finishes,
+        //    and stop any import or export until they can be.
+        void        startPrefetch();
 
-        std::vector<FileInfo>&      getFileInfoArray()          { return blueprint.files;       }
+        const std::vector<FileInfo>&    getFileInfoArray() const    { return blueprint.files;       }
+        void                        setFileName(std::size_t index, const FileName& name);     // of blueprint.files[index]
         const FileName&             getProjectFileName() const  { return projectFileName;       }
         
         void        doImport();
+        void        doExport();
+        //  Saving -- defined in project_save.cpp.  doSave starts a save, which may finish in the background
+        //    (projectStateChanged is emitted when it does).  waitForSave waits for that, and returns false
+        //    if the save failed.
         bool        doSave();
+        bool        isSaving() const    { return saveJob != nullptr;    }
+        bool        waitForSave();
+
+        //  Autosave recovery -- defined in project_journal.cpp.  If the program didn't shut down properly
+        //    the last time this project was open, hasRecovery is true after opening it, and recover
+        //    brings back the changes that were never saved.
+        bool        hasRecovery() const;
+        void        recover();
+        void        discardRecovery();
+
+        //  Switches the project file between the json and binary formats.  Takes effect on the next save.
+        bool        isSavedAsBinary() const     { return saveBinary;            }
+        void        setSaveAsBinary(bool binary);
+
+        bool        canUndo() const     { return !undoStack.empty();    }
+        bool        canRedo() const     { return !redoStack.empty();    }
+        void        undo();
+        void        redo();
+
+        //  Secondary indexes (see valueindex.h).  Indexes are created the first time they're asked for,
+        //    and kept up to date from then on.
+        const ValueIndex&   getIndex(const std::string& pattern);
+
+        //  A read-only copy of the project data.  Unlike everything else here, this can be called from any
+        //    thread.  The copy never changes, no matter what happens to the project afterward, and it only
+        //    ever reflects the data between operations (never halfway through an import, for example).
+        DataStore           getSnapshot() const;
 
     signals:
         void        projectStateChanged();
+        void        saveThreadDone();           // internal -- the save thread is finished
+        void        prefetchThreadDone();       // internal -- the prefetch thread is finished
         
     private:
         int         lua_openFile(Lua& lua);
         int         lua_setData(Lua& lua);
         int         lua_getData(Lua& lua);
+        int         lua_query(Lua& lua);
 
 
     private:
         void        makeDirty();
-        void        dirtyByData(ProjectData*)   { makeDirty();      }
-
-        FileName    translateFileName(const std::string& name, bool& waswritable);
+        void        setData(const std::string& name, const ProjectData& v);
+
+        //  What a file name given to io.open refers to.  These are cached, by the name given, until the
+        //    project's files change.
+        struct ResolvedFile
+        {
+            std::string     path;           // absolute, with native slashes
+            std::size_t     index;          // of the file ID in blueprint.files
+        };
+        std::unordered_map<std::string, ResolvedFile>   resolvedFiles;
+        static const std::size_t                        maxResolvedFiles = 4096;
+        ResolvedFile        translateFileName(const std::string& name);     // throws if there is no such file.  A copy, since the next lookup can clear the cache
+        void        filesChanged();             // after any file in blueprint.files is pointed somewhere else
         void        bindToLua(Lua& lua);
         void        populateFileInfoIndexes();
 
@@ -57,17 +121,114 @@ namespace lsh
         bool                dirty = false;
         bool                savePretty = true;
         bool                saveAsTree = true;
+        bool                useJournal = false;
+        bool                saveBinary = false;     // see binaryproject.h
+        int                 compressLevel = 0;      // 0 = not compressed, else the zlib level (1-9).  See compresseddevice.h
+        int                 autosaveSeconds = 60;   // 0 = no autosave
 
         Blueprint                                       blueprint;
         FileName                                        projectFileName;
         FileName                                        bpFileName;
         std::unordered_map<std::string, std::size_t>    fileInfoIndexes;
-        std::unordered_map<std::string, ProjectData>    dat;
+        RomImageCache                                   romImages;          // the files in fileInfoIndexes, as opened from Lua
+        DataStore                                       dat;
+
+        //  What getSnapshot returns.  Only ever replaced as a whole (with std::atomic_store), so readers
+        //    never need to lock anything -- they just grab whichever version is current.
+        std::shared_ptr<const DataStore>                published;
+        void        publishSnapshot();
+
+        //  Undo/redo history.  Since DataStores share structure, each entry only costs whatever
+        //    was changed between it and the next one.
+        struct UndoStep
+        {
+            DataStore               data;
+            std::set<std::string>   changed;        // keys that differ between 'data' and the step above it (or the current data)
+        };
+        static const std::size_t                        maxUndoSteps = 100;
+        std::vector<UndoStep>                           undoStack;
+        std::vector<UndoStep>                           redoStack;
+        void        beginUndoStep();
+        void        endUndoStep();
+        void        dataRestored();
+
+        //  The data as it is in the project file (and journal).  Undoing or redoing back to it makes
+        //    the project clean again.
+        DataStore                                       savedData;
+
+        //  Every key changed since the last save.  These are what get appended to the journal.
+        std::set<std::string>                           unsavedKeys;
+        void        noteChanged(const std::string& key);
+
+        std::map<std::string, ValueIndex>               indexes;
+        void        updateIndexes(const std::string& key);
+
+        SectionTracker                                  sectionTracker;
+        void        runSections(bool exporting, const std::vector<int>& toRun, bool partial = false);
         
         bool        pushCallback(const char* callback_name);
 
 
-        json::object dataToJson() const;
+        static void writeDataJson(JsonStreamWriter& out, const DataStore& data, bool asTree);
+
+        /////////////////////////////////////
+        //  Saving -- defined in project_save.cpp and project_journal.cpp
+        //    If the journal is enabled, most saves just append the changed keys to a journal file next
+        //    to the project file, rather than rewriting the whole project.
+        std::int64_t        saveId = 0;             // identifies the last full save.  Journals for any other save are stale
+        bool                fullSaveNeeded = true;  // set when something other than data changed (or there is no project file yet)
+        bool                fullSaveRequested = false;  // fullSaveNeeded was set during the current full save
+        std::uint64_t       changeCount = 0;        // bumped by every change, so a save can tell if anything changed while it ran
+
+        struct SaveJob;
+        std::shared_ptr<SaveJob>    saveJob;        // the full save in progress, if any
+        std::thread                 saveThread;
+        bool                        saveQueued = false;
+        bool                        lastSaveWorked = true;
+        void        startFullSave();
+        void        finishSave();
+        static void writeProjectFile(const SaveJob& job);
+
+        /////////////////////////////////////
+        //  Autosave -- defined in project_journal.cpp
+        std::set<std::string>                           autosaveKeys;       // every key changed since the last autosave
+        QTimer                                          autosaveTimer;
+
+        struct AutosaveJob;
+        std::shared_ptr<AutosaveJob>    autosaveJob;
+        std::thread                     autosaveThread;
+        QString     recoveryFileName() const;
+        void        startAutosaveTimer();
+        void        autosave();
+        void        finishAutosave();
+        void        resetRecovery();
+        static void writeRecovery(const AutosaveJob& job);
+
+        ObjectSidecar       sidecar;                // object values are saved here rather than in the project file
+
+        /////////////////////////////////////
+        //  Prefetch (see startPrefetch)
+        struct PrefetchJob;
+        std::shared_ptr<PrefetchJob>    prefetchJob;
+        std::thread                     prefetchThread;
+        std::vector<std::string>        unreadableFiles;    // IDs of required files the prefetch couldn't read
+        struct VerifiedFile
+        {
+            qint64          size;
+            QDateTime       modified;
+        };
+        std::unordered_map<std::string, VerifiedFile>   verifiedFiles;  // files that matched their blueprint fingerprint, as they were then
+        void        finishPrefetch();
+        void        prefetchSignalled();
+        static void prefetchFiles(PrefetchJob& job);
+        void        checkRequiredFiles();
+
+        QString     journalFileName() const;
+        QString     sidecarFileName() const;
+        std::vector<StoredObject::Ptr>  storableObjects() const;
+        bool        journalShouldCompact() const;
+        void        appendToJournal();
+        void        replayJournal();
     };
 
 }
@@ -0,0 +1,379 @@
+
+#include <QFile>
+#include <QFileInfo>
+#include <functional>
+#include <atomic>
+#include "project.h"
+#include "log.h"
+
+/*
+    The project journal.
+
+    With the journal enabled ("useJournal" in the project's misc settings), a save does not rewrite the
+    project file.  Instead, every key that changed since the last save is appended to a journal file
+    next to the project file (<project>.journal).  Once the journal gets large enough relative to the
+    project file, the next save writes the full project again and deletes the journal.
+
+    The journal is line based.  The first line identifies which full save it belongs to:
+            {"saveId":1234}
+    every line after that is one save:
+            {"data":{"some.key":12,"other.key":null}}
+
+    A journal whose saveId doesn't match the project file is stale (ie, the program died between writing
+    the project file and deleting the old journal) and is ignored.  A partially written final line (the
+    program died mid-append) is also ignored.
+
+    Object values are appended to the object file (see objectsidecar.h) before the journal line which
+    refers to them is written.  Changed objects are written again rather than overwritten, so the
+    object file also counts towards compacting.
+
+    Autosave (further down) writes a recovery file in the same format.
+ */
+
+namespace lsh
+{
+    namespace
+    {
+        //  The journal is compacted when it's larger than this fraction of the project file, or when the
+        //    object file has this fraction of dead space.  (but small files are never worth compacting)
+        const qint64        journalCompactRatio = 2;            // journal > projectsize / 2
+        const qint64        journalMinCompactSize = 64 * 1024;
+
+        //  The journal and the recovery file have the same format
+
+        std::string logHeader(std::int64_t saveId)
+        {
+            json::object hdr;
+            hdr["saveId"] = json::value( saveId );
+            return json::value(hdr).serialize(false) + '\n';
+        }
+
+        std::string logRecord(json::object&& changes)
+        {
+            json::object rec;
+            rec["data"] = json::value( std::move(changes) );
+            return json::value(rec).serialize(false) + '\n';
+        }
+
+        enum class LogResult { Ok, Unreadable, Damaged, Stale };
+
+        //  Calls 'apply' with the data of each record, in order.  Stops at the first damaged record.
+        LogResult readLog(QFile& file, std::int64_t saveId, const std::function<void(const json::object&)>& apply)
+        {
+            if( !file.open( QIODevice::ReadOnly ) )
+                return LogResult::Unreadable;
+
+            bool first = true;
+            while(!file.atEnd())
+            {
+                auto line = file.readLine();
+                bool complete = line.endsWith('\n');
+
+                json::value v;
+                std::string err;
+                json::fastParse(v, line.constData(), line.constData() + line.size(), &err);
+                if(!complete || !err.empty() || !v.is<json::object>())
+                    return LogResult::Damaged;
+
+                auto& obj = v.get<json::object>();
+                if(first)
+                {
+                    first = false;
+                    auto i = obj.find("saveId");
+                    if(i == obj.end() || !i->second.is<std::int64_t>() || i->second.get<std::int64_t>() != saveId)
+                        return LogResult::Stale;
+                    continue;
+                }
+
+                auto i = obj.find("data");
+                if(i != obj.end() && i->second.is<json::object>())
+                    apply( i->second.get<json::object>() );
+            }
+            return LogResult::Ok;
+        }
+    }
+
+    QString Project::journalFileName() const
+    {
+        return QString::fromStdString( projectFileName.getFullPath(true) + ".journal" );
+    }
+
+    QString Project::sidecarFileName() const
+    {
+        return QString::fromStdString( projectFileName.getFullPath(true) + ".bin" );
+    }
+
+    std::vector<StoredObject::Ptr> Project::storableObjects() const
+    {
+        std::vector<StoredObject::Ptr> out;
+        for(auto& i : dat)
+        {
+            if(i.second.getType() == ProjectData::Type::Obj && i.second.shouldSaveToJson())
+                out.push_back( i.second.asStoredObj() );
+        }
+        return out;
+    }
+
+    bool Project::journalShouldCompact() const
+    {
+        QFileInfo project( QString::fromStdString( projectFileName.getFullPath(true) ) );
+        if(!project.exists())
+            return true;
+
+        QFileInfo journal( journalFileName() );
+        auto size = journal.exists() ? journal.size() : 0;
+        if(size > journalMinCompactSize && size > project.size() / journalCompactRatio)
+            return true;
+
+        //  Journal saves also leave old copies of objects in the object file, and only a full save gets rid
+        //    of them.  So that gets the same rule, against the space the live objects take up.
+        QFileInfo objfile( sidecarFileName() );
+        if(objfile.size() <= journalMinCompactSize)
+            return false;
+
+        auto dead = sidecar.deadBytes( storableObjects() );
+        return dead > journalMinCompactSize && dead > objfile.size() / journalCompactRatio;
+    }
+
+    void Project::appendToJournal()
+    {
+        QFile file( journalFileName() );
+        bool isnew = !file.exists();
+        if( !file.open( QIODevice::WriteOnly | QIODevice::Append ) )
+            throw Error( "Unable to open journal file '" + file.fileName() + "' for writing" );
+
+        if(isnew)
+        {
+            auto line = logHeader(saveId);
+            file.write(line.data(), line.size());
+        }
+
+        //  Objects have to be in the object file before anything can refer to them
+        std::vector<StoredObject::Ptr> objects;
+        for(auto& key : unsavedKeys)
+        {
+            auto v = dat.find(key);
+            if(v && v->getType() == ProjectData::Type::Obj && v->shouldSaveToJson())
+                objects.push_back( v->asStoredObj() );
+        }
+        sidecar.append( sidecarFileName(), saveId, objects );
+
+        json::object changes;
+        for(auto& key : unsavedKeys)
+        {
+            auto v = dat.find(key);
+            changes[key] = v ? v->toJson() : json::value();
+        }
+
+        auto line = logRecord( std::move(changes) );
+        if( file.write(line.data(), line.size()) != static_cast<qint64>(line.size()) || !file.flush() )
+            throw Error( "Error writing to journal file '" + file.fileName() + "':  " + file.errorString() );
+    }
+
+    void Project::replayJournal()
+    {
+        QFile file( journalFileName() );
+        if( !file.exists() )
+            return;
+
+        std::size_t records = 0;
+        auto result = readLog(file, saveId, [&] (const json::object& data)
+        {
+            for(auto& item : data)
+            {
+                dat.set( item.first, ProjectData::fromJson(item.second, &sidecar) );
+                updateIndexes( item.first );
+            }
+            ++records;
+        });
+
+        switch(result)
+        {
+        case LogResult::Ok:
+            break;
+        case LogResult::Unreadable:
+            Log::wrn( "Project journal '" + file.fileName() + "' exists but could not be opened.  Recent changes may be missing." );
+            fullSaveNeeded = true;
+            return;
+        case LogResult::Damaged:
+            Log::wrn( "Project journal '" + file.fileName() + "' has an incomplete or damaged entry, which was ignored." );
+            fullSaveNeeded = true;          // don't append after garbage
+            break;
+        case LogResult::Stale:
+            Log::wrn( "Project journal '" + file.fileName() + "' does not belong to this project file and was ignored." );
+            fullSaveNeeded = true;
+            return;
+        }
+
+        publishSnapshot();
+        if(records)
+            Log::inf( "Replayed " + std::to_string(records) + " journal entries" );
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //////////////////////////////////////////////////////////////////
+    //  Autosave
+    //
+    //  Every so often ("autosaveSeconds" in the misc settings), whatever changed since the last autosave is
+    //  appended to a recovery file next to the project (<project>.recovery), in the same format as the
+    //  journal.  The recovery file is deleted whenever the project is saved, or closed without saving -- so
+    //  if it's there when the project is opened, the program didn't shut down properly, and it holds every
+    //  change made since the last save.
+    //
+    //  The file is written on a separate thread, from a snapshot of the data.  The only work done on the
+    //  main thread is taking the snapshot, so the cost of an autosave depends only on how much changed.
+    //
+    //  Stored objects are not autosaved -- they can only be written along with the object file.
+
+    struct Project::AutosaveJob
+    {
+        QString                 path;
+        std::int64_t            saveId;
+        DataStore               data;
+        std::set<std::string>   keys;
+        std::string             error;
+        std::atomic<bool>       done{false};
+    };
+
+    QString Project::recoveryFileName() const
+    {
+        return QString::fromStdString( projectFileName.getFullPath(true) + ".recovery" );
+    }
+
+    void Project::startAutosaveTimer()
+    {
+        if(loaded && autosaveSeconds > 0)       autosaveTimer.start( autosaveSeconds * 1000 );
+        else                                    autosaveTimer.stop();
+    }
+
+    void Project::autosave()
+    {
+        if(!loaded || autosaveKeys.empty())
+            return;
+        if(autosaveJob)
+        {
+            if(!autosaveJob->done)
+                return;             // the last one is still going.  Catch up next time
+            finishAutosave();
+        }
+
+        auto job = std::make_shared<AutosaveJob>();
+        job->path =     recoveryFileName();
+        job->saveId =   saveId;
+        job->data =     dat;
+        job->keys =     std::move(autosaveKeys);
+        autosaveKeys.clear();
+
+        autosaveJob = job;
+        autosaveThread = std::thread( [job] ()
+        {
+            try                             { writeRecovery(*job);          }
+            catch(std::exception& e)        { job->error = e.what();        }
+            catch(...)                      { job->error = "Unknown error";  }
+            job->done = true;
+        });
+    }
+
+    //  Runs on the autosave thread
+    void Project::writeRecovery(const AutosaveJob& job)
+    {
+        QFile file( job.path );
+        bool isnew = !file.exists();
+        if( !file.open( QIODevice::WriteOnly | QIODevice::Append ) )
+            throw Error( "Unable to open recovery file '" + job.path + "' for writing" );
+
+        std::string out;
+        if(isnew)
+            out = logHeader(job.saveId);
+
+        json::object changes;
+        for(auto& key : job.keys)
+        {
+            auto v = job.data.find(key);
+            if(v && v->getType() == ProjectData::Type::Obj)
+                continue;
+            changes[key] = v ? v->toJson() : json::value();
+        }
+        out += logRecord( std::move(changes) );
+
+        if( file.write(out.data(), out.size()) != static_cast<qint64>(out.size()) || !file.flush() )
+            throw Error( "Error writing to recovery file '" + job.path + "':  " + file.errorString() );
+    }
+
+    void Project::finishAutosave()
+    {
+        if(!autosaveJob)
+            return;
+
+        autosaveThread.join();
+        auto job = std::move(autosaveJob);
+        autosaveJob.reset();
+
+        if(!job->error.empty())
+        {
+            Log::wrn( "Autosave failed:  " + job->error );
+            autosaveKeys.insert( job->keys.begin(), job->keys.end() );      // try them again next time
+        }
+    }
+
+    //  After a save, the recovery file only needs whatever is still unsaved (ie, what changed during a
+    //    background save)
+    void Project::resetRecovery()
+    {
+        finishAutosave();
+        QFile::remove( recoveryFileName() );
+        autosaveKeys = unsavedKeys;
+    }
+
+    void Project::discardRecovery()
+    {
+        finishAutosave();
+        if(loaded)
+            QFile::remove( recoveryFileName() );
+        autosaveKeys.clear();
+    }
+
+    bool Project::hasRecovery() const
+    {
+        return loaded && QFile::exists( recoveryFileName() );
+    }
+
+    void Project::recover()
+    {
+        finishAutosave();
+
+        QFile file( recoveryFileName() );
+        std::size_t records = 0;
+
+        //  Recovered changes are unsaved changes like any other, and can be undone in one step
+        beginUndoStep();
+        auto result = readLog(file, saveId, [&] (const json::object& data)
+        {
+            for(auto& item : data)
+                setData( item.first, ProjectData::fromJson(item.second) );
+            ++records;
+        });
+        endUndoStep();
+        file.close();
+
+        switch(result)
+        {
+        case LogResult::Ok:
+            break;
+        case LogResult::Unreadable:
+            Log::wrn( "Recovery file '" + file.fileName() + "' could not be opened." );
+            return;
+        case LogResult::Damaged:
+            Log::wrn( "Recovery file '" + file.fileName() + "' has an incomplete or damaged entry.  Changes after that point could not be recovered." );
+            break;
+        case LogResult::Stale:
+            Log::wrn( "Recovery file '" + file.fileName() + "' does not belong to this project file and was ignored." );
+            break;
+        }
+
+        //  Everything recovered is in autosaveKeys now, so it all gets written to a fresh file
+        QFile::remove( file.fileName() );
+        publishSnapshot();
+        Log::inf( "Recovered " + std::to_string(records) + " autosaves" );
+    }
+}
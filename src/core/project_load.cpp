@@ -0,0 +1,288 @@
+
+#include <algorithm>
+#include <QFile>
+#include "project.h"
+#include "log.h"
+#include "versioninfo.h"
+#include "binaryproject.h"
+#include "util/jsonstreamreader.h"
+#include "util/compresseddevice.h"
+
+/*
+    Opening a project file.  This covers json project files -- binary ones (see binaryproject.h) are
+    read by BinaryProjectFile, and everything after that is the same for both.  Either can be compressed
+    (see compresseddevice.h), in which case it's read through a CompressedDevice.
+
+    The file is read a token at a time with JsonStreamReader (see jsonstreamreader.h), which maps the
+    file or reads it through a small buffer.  The "data" block -- which is where basically all of the
+    size is -- never becomes json:  each value goes straight into a list of key/value pairs as it's
+    read, and the DataStore is built from that list in one go.  Every other block is tiny, so those are
+    just read as json.
+
+    The blocks are in alphabetical order in the file, so "data" is read before "header".  Object values
+    refer to the object file, which can't be opened until we know the save id from the header, so those
+    are set aside and resolved at the end.
+ */
+
+namespace lsh
+{
+    namespace
+    {
+        typedef JsonStreamReader::Token     Token;
+
+        struct LoadState
+        {
+            DataStore::ItemList                                 items;
+            BinaryProjectFile::RefList                          objectRefs;
+            std::size_t                                         skipped = 0;        // arrays, which project data can't hold
+            std::string                                         key;                // key of the value being read
+        };
+
+        void readDataObject(JsonStreamReader& in, LoadState& st, Token tok);
+
+        //  A stored object reference has exactly this shape (see objectsidecar.h).  Anything else is a
+        //    level of the tree, even with a member named "$obj".
+        bool isObjectRef(const json::object& obj)
+        {
+            auto tag  = obj.find("$obj");
+            auto at   = obj.find("at");
+            auto size = obj.find("size");
+            return  obj.size() == 3 &&
+                    tag  != obj.end() && tag->second.is<std::string>() &&
+                    at   != obj.end() && at->second.is<std::int64_t>() &&
+                    size != obj.end() && size->second.is<std::int64_t>();
+        }
+
+        //  Same as readDataValue, for a value that had to be read whole to find it wasn't a reference
+        void readDataJson(const json::value& v, LoadState& st)
+        {
+            if     (v.is<bool>())           st.items.emplace_back( st.key, ProjectData(v.get<bool>()) );
+            else if(v.is<std::int64_t>())   st.items.emplace_back( st.key, ProjectData(static_cast<ProjectData::int_t>(v.get<std::int64_t>())) );
+            else if(v.is<double>())         st.items.emplace_back( st.key, ProjectData(v.get<double>()) );
+            else if(v.is<std::string>())    st.items.emplace_back( st.key, ProjectData(v.get<std::string>()) );
+            else if(v.is<json::array>())    ++st.skipped;
+            else if(v.is<json::object>())
+            {
+                for(auto& i : v.get<json::object>())
+                {
+                    auto len = st.key.size();
+                    if(len)     st.key += '.';
+                    st.key += i.first;
+
+                    readDataJson(i.second, st);
+                    st.key.resize(len);
+                }
+            }
+        }
+
+        //  A value in the "data" block.  An object is a level of the tree (see Project::writeDataJson),
+        //    unless it's a reference to a stored object.  Those start with "$obj", so only objects that
+        //    do are read whole to check.
+        void readDataValue(JsonStreamReader& in, LoadState& st, Token tok)
+        {
+            switch(tok)
+            {
+            case Token::Null:           break;
+            case Token::Bool:           st.items.emplace_back( st.key, ProjectData(in.boolValue()) );        break;
+            case Token::Int:            st.items.emplace_back( st.key, ProjectData(static_cast<ProjectData::int_t>(in.intValue())) );    break;
+            case Token::Double:         st.items.emplace_back( st.key, ProjectData(in.doubleValue()) );      break;
+            case Token::String:         st.items.emplace_back( st.key, ProjectData(in.stringValue()) );      break;
+            case Token::BeginArray:     ++st.skipped;   in.skipValue(tok);                                  break;
+            case Token::BeginObject:
+                {
+                    tok = in.next();
+                    if(tok == Token::EndObject || in.key() != "$obj")
+                    {
+                        readDataObject(in, st, tok);
+                        break;
+                    }
+
+                    json::object ref;
+                    for(; tok != Token::EndObject; tok = in.next())
+                    {
+                        auto& v = ref[in.key()];
+                        in.readValue(tok, v);
+                    }
+
+                    if(isObjectRef(ref))        st.objectRefs.emplace_back( st.key, json::value(std::move(ref)) );
+                    else                        readDataJson( json::value(std::move(ref)), st );
+                }
+                break;
+            default:
+                break;
+            }
+        }
+
+        //  The members of an object in the "data" block, starting with 'tok' (the first one)
+        void readDataObject(JsonStreamReader& in, LoadState& st, Token tok)
+        {
+            for(; tok != Token::EndObject; tok = in.next())
+            {
+                auto len = st.key.size();
+                if(len)     st.key += '.';
+                st.key += in.key();
+
+                readDataValue(in, st, tok);
+                st.key.resize(len);
+            }
+        }
+
+        //  The whole file
+        void readFile(JsonStreamReader& in, LoadState& st, json::object& blocks)
+        {
+            if(in.next() != Token::BeginObject)
+                throw Error( "File does not contain a root object" );
+
+            for(auto tok = in.next(); tok != Token::EndObject; tok = in.next())
+            {
+                if(in.key() == "data")
+                {
+                    if(tok != Token::BeginObject)
+                        throw Error( "Project file does not contain a valid 'data' block" );
+                    readDataObject(in, st, in.next());
+                }
+                else
+                {
+                    auto& v = blocks[in.key()];
+                    in.readValue(tok, v);
+                }
+            }
+            in.next();              // throws if there's anything after the end
+        }
+
+        const json::object& getBlock(const json::object& blocks, const char* name)
+        {
+            auto i = blocks.find(name);
+            if(i == blocks.end() || !i->second.is<json::object>())
+                throw Error( std::string("Project file does not contain a valid '") + name + "' block" );
+            return i->second.get<json::object>();
+        }
+    }
+
+    void Project::openProject(const FileName& projectPath, const FileName& blueprintRoot)
+    {
+        QString path = QString::fromStdString( projectPath.getFullPath(true) );
+        QFile file(path);
+        if( !file.open( QIODevice::ReadOnly ) )
+            throw Error( "Unable to open project file '" + path + "'" );
+
+        //////////////////////////////////////////////
+        //  Parse it
+        LoadState       st;
+        json::object    blocks;
+
+        CompressedDevice unzip(file);
+        QIODevice* src = &file;
+        if(CompressedDevice::isCompressed(file))
+        {
+            if( !unzip.open( QIODevice::ReadOnly ) )
+                throw Error( "Error reading project file '" + path + "':  " + unzip.errorString() );
+            src = &unzip;
+        }
+
+        if(BinaryProjectFile::isBinary(*src))
+            BinaryProjectFile::read(*src, blocks, st.items, st.objectRefs);
+        else
+        {
+            try
+            {
+                JsonStreamReader in(*src);
+                readFile(in, st, blocks);
+            }
+            catch(std::exception& e)
+            {
+                throw Error( "Error reading project file '" + path + "':  " + QString::fromStdString(e.what()) );
+            }
+        }
+        file.close();
+
+        //////////////////////////////////////////////
+        //  Header
+        std::int64_t fileSaveId = 0;
+        {
+            auto& blk = getBlock(blocks, "header");
+            bool ok = false;
+            json::readField<std::string>(blk, "filetype", [&] (const std::string& v) { ok = (v == projectFileHeaderString); } );
+            if(!ok)
+                throw Error( "File '" + path + "' is not a Lusch project file" );
+
+            json::readField<std::int64_t>(blk, "saveId", [&] (const std::int64_t& v) { fileSaveId = v; } );
+        }
+
+        //////////////////////////////////////////////
+        //  Blueprint -- which sets up everything else just like a new project
+        {
+            auto& blk = getBlock(blocks, "blueprint");
+            FileName bpRel;
+            if(!json::readField<std::string>(blk, "name", [&] (const std::string& v) { bpRel = v; } ))
+                throw Error( "Project file does not specify a blueprint" );
+
+            FileName bpAbs = bpRel;
+            bpAbs.makeAbsoluteWith(blueprintRoot);
+
+            Blueprint bp;
+            bp.load(bpAbs);
+            newProject(projectPath, bpRel, std::move(bp));
+        }
+
+        //////////////////////////////////////////////
+        //  Files, sections, settings
+        {
+            auto& blk = getBlock(blocks, "files");
+            for(auto& x : blueprint.files)
+                json::readField<std::string>(blk, x.id, [&] (const std::string& v) { x.fileName = v; } );
+            filesChanged();
+        }
+        {
+            auto& blk = getBlock(blocks, "sections");
+            for(auto& x : blueprint.sections)
+            {
+                json::readField<json::object>(blk, x.id, [&] (const json::object& sec)
+                {
+                    json::readField<bool>(sec, "toImport", [&] (const bool& v) { x.toImport = v; } );
+                    json::readField<bool>(sec, "toExport", [&] (const bool& v) { x.toExport = v; } );
+                });
+            }
+        }
+        {
+            auto i = blocks.find("misc settings");
+            if(i != blocks.end() && i->second.is<json::object>())
+            {
+                auto& blk = i->second.get<json::object>();
+                json::readField<bool>(blk, "savePretty", [&] (const bool& v) { savePretty = v; } );
+                json::readField<bool>(blk, "saveAsTree", [&] (const bool& v) { saveAsTree = v; } );
+                json::readField<bool>(blk, "useJournal", [&] (const bool& v) { useJournal = v; } );
+                json::readField<bool>(blk, "saveBinary", [&] (const bool& v) { saveBinary = v; } );
+                json::readField<std::int64_t>(blk, "autosaveSeconds", [&] (const std::int64_t& v) { autosaveSeconds = static_cast<int>( std::max<std::int64_t>(0, std::min<std::int64_t>(24*60*60, v)) ); } );
+                json::readField<std::int64_t>(blk, "compressLevel", [&] (const std::int64_t& v) { compressLevel = static_cast<int>( std::max<std::int64_t>(0, std::min<std::int64_t>(9, v)) ); } );
+            }
+        }
+
+        //////////////////////////////////////////////
+        //  Data
+        dat.assign( std::move(st.items) );
+
+        saveId = fileSaveId;
+        sidecar.open( sidecarFileName(), saveId );
+
+        std::size_t missing = 0;
+        for(auto& i : st.objectRefs)
+        {
+            auto v = ProjectData::fromJson(i.second, &sidecar);
+            if(v.getType() == ProjectData::Type::Obj)       dat.set(i.first, v);
+            else                                            ++missing;
+        }
+        if(missing)
+            Log::wrn( std::to_string(missing) + " stored objects could not be found in the project's object file, and were not loaded." );
+        if(st.skipped)
+            Log::wrn( std::to_string(st.skipped) + " arrays found in the project data were ignored." );
+
+        fullSaveNeeded = false;
+        replayJournal();
+        savedData = dat;
+        publishSnapshot();
+        startAutosaveTimer();
+
+        Log::inf( "Loaded " + std::to_string(dat.size()) + " values" );
+    }
+}
@@ -0,0 +1,271 @@
+
+#include <QFile>
+#include <QSaveFile>
+#include <QDateTime>
+#include "project.h"
+#include "log.h"
+#include "versioninfo.h"
+#include "binaryproject.h"
+#include "util/safecall.h"
+#include "util/jsonstreamwriter.h"
+#include "util/compresseddevice.h"
+
+/*
+    Saving the project.
+
+    Journal saves (see project_journal.cpp) only write what changed, so they're quick and are just done
+    on the spot.  Full saves write everything, which for a large project takes a while -- so the project
+    file is written on a separate thread, and the program carries on while that happens.
+
+    A full save works off a snapshot of the data (DataStores are cheap to copy), so anything changed
+    while it's in progress simply isn't part of that save.  Those changes are still unsaved when the
+    save finishes, and the project stays dirty.
+
+    The file is written with QSaveFile, which writes to a temporary file and only replaces the project
+    file once everything has been written.  If anything goes wrong (or the program dies partway through)
+    the previous project file is left as it was.
+
+    Only one save runs at a time.  Saving while a save is in progress just saves again once it's done.
+    Anything which replaces the project (opening or creating another one) waits for the save to finish
+    first.
+ */
+
+namespace lsh
+{
+    struct Project::SaveJob
+    {
+        //  What to write
+        QString                 path;
+        DataStore               data;
+        json::object            blocks;             // everything except the data
+        bool                    pretty;
+        bool                    asTree;
+        bool                    binary;
+        int                     compressLevel;
+
+        //  Bookkeeping for when it's done
+        std::int64_t            saveId;
+        std::uint64_t           changeCount;        // the project's change count when the save was started
+        std::set<std::string>   keys;               // keys which were unsaved before this save started
+
+        std::string             error;              // empty if the save worked
+    };
+
+    bool Project::doSave()
+    {
+        BEGIN_SAFE
+            if(saveJob)
+            {
+                saveQueued = true;          // save again as soon as this one is done
+                return true;
+            }
+
+            if(useJournal && !fullSaveNeeded && !journalShouldCompact())
+            {
+                appendToJournal();
+                unsavedKeys.clear();
+                savedData = dat;
+                resetRecovery();
+
+                dirty = false;                  // project is no longer dirty (we just saved it)
+                emit projectStateChanged();     // which means we also want to emit the event to indicate dirty state changed
+            }
+            else
+            {
+                startFullSave();
+                emit projectStateChanged();     // now saving
+            }
+
+            return true;
+        END_SAFE
+        return false;
+    }
+
+    bool Project::waitForSave()
+    {
+        while(saveJob)
+            finishSave();           // which might start a queued save
+        return lastSaveWorked;
+    }
+
+    void Project::startFullSave()
+    {
+        // A new save id makes any existing journal stale, should we fail to remove it later
+        auto newSaveId = std::max<std::int64_t>( saveId + 1, QDateTime::currentMSecsSinceEpoch() );
+
+        // Objects are written first, since the project file refers to them by their position in the
+        //   object file.  The new object file only replaces the old one once the project file has been
+        //   written (see objectsidecar.h), and nothing can be appended to the journal until then.
+        //   Objects belong to the program, not the snapshot, so this part isn't done in the background.
+        fullSaveNeeded = true;
+        fullSaveRequested = false;
+        sidecar.rewrite( sidecarFileName(), newSaveId, storableObjects() );
+
+        auto job = std::make_shared<SaveJob>();
+        job->path =             QString::fromStdString( projectFileName.getFullPath(true) );
+        job->data =             dat;
+        job->pretty =           savePretty;
+        job->asTree =           saveAsTree;
+        job->binary =           saveBinary;
+        job->compressLevel =    compressLevel;
+        job->saveId =           newSaveId;
+        job->changeCount =      changeCount;
+        job->keys =             std::move(unsavedKeys);
+        unsavedKeys.clear();
+
+        //  Everything except the data is small, so it's just built as json.  The data is streamed
+        //    straight out of the store when the file is written.
+        auto& mainobj = job->blocks;
+        {
+            auto& blk = json::setNew<json::object>(mainobj["header"]);
+            blk["filetype"] = json::value( projectFileHeaderString );
+            blk["version"]  = json::value( projectFileVersion      );
+            blk["saveId"]   = json::value( newSaveId               );
+        }
+        {
+            auto& blk = json::setNew<json::object>(mainobj["misc settings"]);
+            blk["savePretty"]     = json::value(savePretty);
+            blk["saveAsTree"]     = json::value(saveAsTree);
+            blk["useJournal"]     = json::value(useJournal);
+            blk["saveBinary"]     = json::value(saveBinary);
+            blk["compressLevel"]  = json::value(static_cast<std::int64_t>(compressLevel));
+            blk["autosaveSeconds"] = json::value(static_cast<std::int64_t>(autosaveSeconds));
+        }
+        {
+            auto& blk = json::setNew<json::object>(mainobj["blueprint"]);
+            blk["name"] = json::value( bpFileName.getFullPath() );
+            //  TODO - record blueprint version?
+        }
+        {
+            auto& blk = json::setNew<json::object>(mainobj["files"]);
+            for(auto& x : blueprint.files)
+            {
+                blk[x.id] = json::value( x.fileName.getFullPath() );
+            }
+        }
+        {
+            auto& blk = json::setNew<json::object>(mainobj["sections"]);
+            for(auto& x : blueprint.sections)
+            {
+                auto& i = json::setNew<json::object>(blk[x.id]);
+                i["toImport"] = json::value( x.toImport );
+                i["toExport"] = json::value( x.toExport );
+            }
+        }
+
+        saveJob = job;
+        saveThread = std::thread( [this, job] ()
+        {
+            try                             { writeProjectFile(*job);       }
+            catch(std::exception& e)        { job->error = e.what();        }
+            catch(...)                      { job->error = "Unknown error";  }
+            emit saveThreadDone();          // finishSave, back on the main thread
+        });
+    }
+
+    //  Runs on the save thread.  Touches nothing but the job.
+    void Project::writeProjectFile(const SaveJob& job)
+    {
+        QSaveFile file( job.path );
+        if( !file.open( QIODevice::WriteOnly ) )
+            throw Error( "Unable to open file '" + job.path + "' for writing" );
+
+        //  Compression is streamed as well -- nothing more than a frame of data is ever held in memory
+        CompressedDevice zip(file, job.compressLevel);
+        QIODevice* dest = &file;
+        if(job.compressLevel > 0)
+        {
+            if( !zip.open( QIODevice::WriteOnly ) )
+                throw Error( "Error writing to file '" + job.path + "':  " + zip.errorString() );
+            dest = &zip;
+        }
+
+        if(job.binary)
+            BinaryProjectFile::write(*dest, job.blocks, job.data);
+        else
+        {
+            //  Blocks are written in sorted order, same as they'd be if "data" were in mainobj
+            const std::string dataBlock = "data";
+            bool dataWritten = false;
+
+            JsonStreamWriter out(*dest, job.pretty);
+            out.beginObject();
+            for(auto& blk : job.blocks)
+            {
+                if(!dataWritten && dataBlock < blk.first)
+                {
+                    out.key(dataBlock);
+                    writeDataJson(out, job.data, job.asTree);
+                    dataWritten = true;
+                }
+                out.key(blk.first);
+                out.value(blk.second);
+            }
+            if(!dataWritten)
+            {
+                out.key(dataBlock);
+                writeDataJson(out, job.data, job.asTree);
+            }
+            out.endObject();
+            out.finish();
+        }
+
+        if(dest == &zip)
+            zip.finish();
+
+        //  Replaces the old project file in one go
+        if(!file.commit())
+            throw Error( "Error writing to file '" + job.path + "':  " + file.errorString() );
+    }
+
+    void Project::finishSave()
+    {
+        if(!saveJob)
+            return;                 // already finished (by waitForSave)
+
+        saveThread.join();
+        auto job = std::move(saveJob);
+        saveJob.reset();
+
+        if(job->error.empty())
+        {
+            // The project file has everything now -- the journal is no longer needed
+            saveId = job->saveId;
+            fullSaveNeeded = fullSaveRequested;
+            savedData = job->data;
+            try
+            {
+                sidecar.commitRewrite();
+            }
+            catch(std::exception& e)
+            {
+                //  The next open still finds the new object file.  But until it's in place, nothing
+                //    can be appended to it -- the next save has to be a full one.
+                Log::err( e.what() );
+                fullSaveNeeded = true;
+            }
+            QFile::remove( journalFileName() );
+
+            if(changeCount == job->changeCount)
+                dirty = false;      // otherwise, something was changed during the save
+            lastSaveWorked = true;
+            resetRecovery();
+        }
+        else
+        {
+            Log::err( "Unable to save project:  " + job->error );
+            sidecar.abortRewrite();             // the old object file still goes with the old project file
+            unsavedKeys.insert( job->keys.begin(), job->keys.end() );
+            lastSaveWorked = false;
+            saveQueued = false;     // it'd just fail again
+        }
+
+        emit projectStateChanged();
+
+        if(saveQueued)
+        {
+            saveQueued = false;
+            doSave();
+        }
+    }
+}
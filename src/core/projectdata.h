@@ -2,47 +2,61 @@
 #define LUSCH_CORE_PROJECTDATA_H_INCLUDED
 
 #include <memory>
-#include <QObject>
 #include "lua/objects/lua_object.h"
 #include "util/qtjson.h"
+#include "objectsidecar.h"
+
+/*
+    ProjectData is a plain value.  It used to be a QObject that emitted a signal whenever it changed,
+    but values now live in a DataStore (see datastore.h) which never modifies anything in place -- so
+    there is nothing to observe.  Anything that changes project data goes through the Project, and the
+    Project is what tracks dirtiness.
+
+    Object values are held as a StoredObject, so they can be loaded from the project's object file only
+    when they're actually needed.  See objectsidecar.h.
+ */
 
 namespace lsh
 {
-    class ProjectData : public QObject
+    class ProjectData
     {
-        Q_OBJECT
-
     public:
         enum class Type {   Null,   Bool,   Int,    Dbl,    Str,    Obj     };
 
-        typedef std::unique_ptr<ProjectData>    Ptr;
         typedef std::int64_t                    int_t;
 
-        virtual         ~ProjectData() = default;
+                        ProjectData() = default;
+        explicit        ProjectData(bool v)                     { set(v);       }
+        explicit        ProjectData(const std::string& v)       { set(v);       }
+        explicit        ProjectData(int_t v)                    { set(v);       }
+        explicit        ProjectData(double v)                   { set(v);       }
+        explicit        ProjectData(const LuaObject::Ptr& v)    { set(v);       }
+        explicit        ProjectData(const StoredObject::Ptr& v) { set(v);       }
 
 
         Type            getType() const             { return type;  }
 
-        std::string     asString() const            { return v_str; }
+        const std::string&  asString() const        { return v_str; }
         int_t           asInt() const               { return v_int; }
         bool            asBool() const              { return v_bool; }
         double          asDbl() const               { return v_dbl; }
-        LuaObject::Ptr  asObj() const               { return v_obj; }
+        LuaObject::Ptr  asObj() const               { return v_obj ? v_obj->get() : nullptr;    }
+        const StoredObject::Ptr& asStoredObj() const    { return v_obj; }
 
-        bool            shouldSaveToJson() const    { return type != Type::Null;        }       // TODO, this may change for some objects.
-        json::value     toJson() const;
-        
-    public slots:
-        void            setNull()                   { type = Type::Null;                v_obj.reset();  emit dataChanged(this); }
-        void            set(bool v)                 { type = Type::Str;     v_bool = v; v_obj.reset();  emit dataChanged(this); }
-        void            set(const std::string& v)   { type = Type::Str;     v_str = v;  v_obj.reset();  emit dataChanged(this); }
-        void            set(int_t v)                { type = Type::Int;     v_int = v;  v_obj.reset();  emit dataChanged(this); }
-        void            set(double v)               { type = Type::Dbl;     v_dbl = v;  v_obj.reset();  emit dataChanged(this); }
-        void            set(const LuaObject::Ptr& v){ type = Type::Obj;     v_obj = v;                  emit dataChanged(this); }
+        bool            shouldSaveToJson() const;
+        json::value     toJson() const;                 // objects must have been written to the object file first
+        static ProjectData  fromJson(const json::value& v, ObjectSidecar* sidecar = nullptr);
 
+        bool            operator == (const ProjectData& rhs) const;
+        bool            operator != (const ProjectData& rhs) const  { return !(*this == rhs);   }
 
-    signals:
-        void            dataChanged(ProjectData* dat);
+        void            setNull()                   { type = Type::Null;                v_obj.reset();  }
+        void            set(bool v)                 { type = Type::Bool;    v_bool = v; v_obj.reset();  }
+        void            set(const std::string& v)   { type = Type::Str;     v_str = v;  v_obj.reset();  }
+        void            set(int_t v)                { type = Type::Int;     v_int = v;  v_obj.reset();  }
+        void            set(double v)               { type = Type::Dbl;     v_dbl = v;  v_obj.reset();  }
+        void            set(const LuaObject::Ptr& v){ type = Type::Obj;     v_obj = StoredObject::fromObject(v);    }
+        void            set(const StoredObject::Ptr& v) { type = Type::Obj;   v_obj = v;                  }
 
     private:
         Type            type = Type::Null;
@@ -50,12 +64,12 @@ namespace lsh
         int_t           v_int = 0;
         double          v_dbl = 0;
         std::string     v_str;
-        LuaObject::Ptr  v_obj;
+        StoredObject::Ptr   v_obj;
     };
-    
+
     /////////////////////////////////////////////////////
     /////////////////////////////////////////////////////
-    
+
     inline json::value ProjectData::toJson() const
     {
         switch(type)
@@ -64,12 +78,78 @@ namespace lsh
         case Type::Int:         return json::value( v_int );
         case Type::Dbl:         return json::value( v_dbl );
         case Type::Str:         return json::value( v_str );
-        case Type::Obj:         /* TODO */      break;
+        case Type::Obj:
+            {
+                std::int64_t at, size;
+                if(v_obj && v_obj->getLocation(at, size))
+                {
+                    json::object ref;
+                    ref["$obj"] = json::value( v_obj->getTag() );
+                    ref["at"]   = json::value( at );
+                    ref["size"] = json::value( size );
+                    return json::value( std::move(ref) );
+                }
+            }
+            break;
         }
 
         return json::value();
     }
 
+    inline bool ProjectData::shouldSaveToJson() const
+    {
+        if(type == Type::Obj)
+            return v_obj && v_obj->isStorable();
+        return type != Type::Null;
+    }
+
+    inline ProjectData ProjectData::fromJson(const json::value& v, ObjectSidecar* sidecar)
+    {
+        if(v.is<bool>())                return ProjectData( v.get<bool>() );
+        if(v.is<std::int64_t>())        return ProjectData( static_cast<int_t>(v.get<std::int64_t>()) );
+        if(v.is<double>())              return ProjectData( v.get<double>() );
+        if(v.is<std::string>())         return ProjectData( v.get<std::string>() );
+
+        if(v.is<json::object>() && sidecar)
+        {
+            auto& obj = v.get<json::object>();
+            auto tag  = obj.find("$obj");
+            auto at   = obj.find("at");
+            auto size = obj.find("size");
+            if( tag  != obj.end() && tag->second.is<std::string>() &&
+                at   != obj.end() && at->second.is<std::int64_t>() &&
+                size != obj.end() && size->second.is<std::int64_t>() )
+            {
+                auto ref = sidecar->reference( tag->second.get<std::string>(), at->second.get<std::int64_t>(), size->second.get<std::int64_t>() );
+                if(ref)
+                    return ProjectData( ref );
+            }
+        }
+
+        return ProjectData();
+    }
+
+    inline bool ProjectData::operator == (const ProjectData& rhs) const
+    {
+        if(type != rhs.type)            return false;
+
+        switch(type)
+        {
+        case Type::Bool:        return v_bool == rhs.v_bool;
+        case Type::Int:         return v_int  == rhs.v_int;
+        case Type::Dbl:         return v_dbl  == rhs.v_dbl;
+        case Type::Str:         return v_str  == rhs.v_str;
+        case Type::Obj:
+            //  An object that hasn't been loaded can't be the same as one that has.  Don't load it just to compare.
+            if(v_obj == rhs.v_obj)                                      return true;
+            if(!v_obj || !rhs.v_obj)                                    return false;
+            if(!v_obj->isLoaded() || !rhs.v_obj->isLoaded())            return false;
+            return v_obj->get() == rhs.v_obj->get();
+        }
+
+        return true;        // both null
+    }
+
 }
 
-#endif
\ No newline at end of file
+#endif
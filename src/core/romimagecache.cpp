@@ -0,0 +1,265 @@
+
+#include <cstring>
+#include <algorithm>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include "romimagecache.h"
+#include "util/rompatch.h"
+#include "error.h"
+#include "log.h"
+
+namespace lsh
+{
+    namespace
+    {
+        //  Changes closer together than this are written together, and replaced images are compared
+        //    a block this size at a time
+        const qint64            writeBlockSize = 4096;
+
+        //  Modification times within this long of when they were noted can't be trusted to change (FAT
+        //    keeps them to 2 seconds)
+        const qint64            racyWindowMs = 2000;
+    }
+
+    void RomImageCache::Image::markDirty(qint64 pos, qint64 size)
+    {
+        dirty = true;
+        if(replaced || size <= 0)
+            return;
+
+        //  Writes are usually one after the other, so most just extend the last range
+        if(!dirtyRanges.empty() && pos >= dirtyRanges.back().first && pos <= dirtyRanges.back().second)
+            dirtyRanges.back().second = std::max( dirtyRanges.back().second, pos + size );
+        else
+            dirtyRanges.emplace_back(pos, pos + size);
+    }
+
+    RomImageCache::Ptr RomImageCache::open(const std::string& id, const QString& path, Mode mode, const Ptr& base)
+    {
+        auto& image = images[id];
+
+        //  The blueprint's file was pointed somewhere else -- anything cached is for the old file
+        if(image && image->path != path)
+        {
+            flush();
+            image.reset();
+        }
+        if(!image)
+        {
+            image = std::make_shared<Image>();
+            image->path = path;
+        }
+        image->base = base;
+
+        if(mode == Mode::Truncate)
+        {
+            image->data.clear();
+            image->markReplaced();
+            return image;
+        }
+
+        //  A patch also has to be remade if what it's a patch of has changed.  Any change to the base's
+        //    data (or reloading it) detaches it from the copy kept here.
+        if(image->dirty || (matchesDisk(*image) && (!base || base->data.constData() == image->baseData.constData())))
+            return image;
+
+        QFile file(path);
+        if(!file.open(QIODevice::ReadOnly))
+        {
+            if(mode == Mode::Existing)
+            {
+                images.erase(id);
+                return nullptr;
+            }
+
+            image->data.clear();
+            image->markReplaced();          // so the file gets created
+            return image;
+        }
+
+        image->data = file.readAll();
+        file.close();
+        image->diskData = image->data;
+        if(base)
+        {
+            try
+            {
+                image->data = RomPatch::apply(base->data, image->data);
+                image->baseData = base->data;
+            }
+            catch(std::exception& e)
+            {
+                images.erase(id);
+                throw Error( "Unable to apply patch '" + path.toStdString() + "':  " + e.what() );
+            }
+        }
+        image->dirtyRanges.clear();
+        image->replaced = false;
+        noteDiskState(*image);
+        return image;
+    }
+
+    void RomImageCache::preload(const std::string& id, const QString& path, const QByteArray& data, qint64 size, const QDateTime& modified, const QDateTime& checked)
+    {
+        auto& image = images[id];
+        if(image && image->path == path)
+            return;
+        if(image)
+            flush();                // same as open:  what's cached is for the old file
+
+        image = std::make_shared<Image>();
+        image->path =           path;
+        image->data =           data;
+        image->diskData =       data;
+        image->diskSize =       size;
+        image->diskModified =   modified;
+        image->diskChecked =    checked;
+    }
+
+    bool RomImageCache::flush()
+    {
+        bool ok = true;
+        for(auto& i : images)
+        {
+            auto& image = *i.second;
+            if(image.dirty && !writeInPlace(image) && !writeWhole(image))
+                ok = false;
+        }
+        return ok;
+    }
+
+    bool RomImageCache::writeWhole(Image& image) const
+    {
+        QByteArray out = image.data;
+        if(image.base)
+        {
+            try
+            {
+                out = RomPatch::create( RomPatch::formatForFile(image.path), image.base->data, image.data );
+            }
+            catch(std::exception& e)
+            {
+                Log::err( "Unable to make patch '" + image.path + "':  " + e.what() );
+                return false;
+            }
+        }
+
+        QSaveFile file(image.path);
+        if( !file.open(QIODevice::WriteOnly) ||
+            file.write(out) != out.size() ||
+            !file.commit() )
+        {
+            Log::err( "Unable to write file '" + image.path + "':  " + file.errorString() );
+            return false;
+        }
+
+        image.dirty = false;
+        image.dirtyRanges.clear();
+        image.replaced = false;
+        image.diskData = image.base ? out : image.data;
+        if(image.base)
+            image.baseData = image.base->data;      // what the patch on disk is against
+        noteDiskState(image);
+        return true;
+    }
+
+    void RomImageCache::clear()
+    {
+        flush();
+        images.clear();
+    }
+
+    bool RomImageCache::writeInPlace(Image& image) const
+    {
+        //  Only if what's on disk is known, and is still the same size
+        if(image.base || image.diskSize < 0 || image.diskSize != image.data.size() || image.diskData.size() != image.data.size() || !matchesDisk(image))
+            return false;
+
+        //  Work out what to write -- changes close together are written together
+        std::vector<std::pair<qint64,qint64>> ranges;
+        if(image.replaced)
+        {
+            auto now = image.data.constData();
+            auto was = image.diskData.constData();
+            for(qint64 pos = 0; pos < image.diskSize; pos += writeBlockSize)
+            {
+                auto len = std::min(writeBlockSize, image.diskSize - pos);
+                if(now == was || !std::memcmp(now + pos, was + pos, len))
+                    continue;
+                if(!ranges.empty() && ranges.back().second == pos)      ranges.back().second = pos + len;
+                else                                                    ranges.emplace_back(pos, pos + len);
+            }
+        }
+        else
+        {
+            auto src = image.dirtyRanges;
+            std::sort(src.begin(), src.end());
+            for(auto& r : src)
+            {
+                if(!ranges.empty() && r.first <= ranges.back().second + writeBlockSize)
+                    ranges.back().second = std::max( ranges.back().second, r.second );
+                else
+                    ranges.push_back(r);
+            }
+        }
+
+        if(!ranges.empty())
+        {
+            QFile file(image.path);
+            if(!file.open(QIODevice::ReadWrite))
+                return false;
+            for(auto& r : ranges)
+            {
+                auto len = std::min(r.second, image.diskSize) - r.first;
+                if(len <= 0)
+                    continue;
+                if(!file.seek(r.first) || file.write(image.data.constData() + r.first, len) != len)
+                {
+                    Log::wrn( "Unable to write file '" + image.path + "' in place (" + file.errorString() + ").  Rewriting all of it." );
+                    return false;           // part of it might be written -- the whole file has to be
+                }
+            }
+            if(!file.flush())
+            {
+                Log::wrn( "Unable to write file '" + image.path + "' in place (" + file.errorString() + ").  Rewriting all of it." );
+                return false;
+            }
+            file.close();
+        }
+
+        image.dirty = false;
+        image.dirtyRanges.clear();
+        image.replaced = false;
+        image.diskData = image.data;
+        noteDiskState(image);
+        return true;
+    }
+
+    bool RomImageCache::matchesDisk(Image& image) const
+    {
+        QFileInfo info(image.path);
+        if(image.diskSize < 0 || !info.exists() || info.size() != image.diskSize || info.lastModified() != image.diskModified)
+            return false;
+
+        //  If the time was noted too soon after it was set, a later change in the same tick wouldn't
+        //    show in it -- check what's in the file
+        if(image.diskModified.msecsTo(image.diskChecked) >= racyWindowMs)
+            return true;
+
+        auto checked = QDateTime::currentDateTime();
+        QFile file(image.path);
+        if(!file.open(QIODevice::ReadOnly) || file.readAll() != image.diskData)
+            return false;
+        image.diskChecked = checked;
+        return true;
+    }
+
+    void RomImageCache::noteDiskState(Image& image) const
+    {
+        QFileInfo info(image.path);
+        image.diskChecked =     QDateTime::currentDateTime();
+        image.diskSize =        info.size();
+        image.diskModified =    info.lastModified();
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef LUSCH_CORE_ROMIMAGECACHE_H_INCLUDED
+#define LUSCH_CORE_ROMIMAGECACHE_H_INCLUDED
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <utility>
+#include <unordered_map>
+#include <QString>
+#include <QByteArray>
+#include <QDateTime>
+
+/*
+    The contents of the project's files (the ones listed in the blueprint), kept in memory.
+
+    Opening a file ID in binary mode from Lua (io.open("srcfile","rb") and friends) gives a handle on one
+    of these images rather than a QFile.  The file is read in full the first time it's opened, and after
+    that opens just share the image -- so re-importing or re-exporting doesn't read the disk again, unless
+    the file was changed on disk since (checked by its size and modification time).  Some file systems
+    only keep modification times to the second (or two), so a change made right after the file was read
+    or written wouldn't show.  If the time noted is that close to when it was noted, the file's contents
+    are compared as well.
+
+    Writes go to the image, and are written to disk all at once by flush(), which the project does at the
+    end of every import or export.  Until then, the image is 'dirty' and is never reloaded from disk.
+
+    Only the parts of the file that changed are written, in place.  Writes mark the ranges they
+    touch (markDirty).  Replacing the whole image (truncating it, or copyfrom) can't say what changed,
+    so then the image is compared against the file as it was last read or written, a block at a time.
+    The whole file is only rewritten if it's new, if its size changed, if something else changed it on
+    disk, if it's a patch, or if writing in place failed.  Rewriting goes through a QSaveFile, so a failed
+    write leaves the old file as it was.
+
+    Images are QByteArrays, so copying one (see LuaIOFile's copyfrom) doesn't copy any data -- both share
+    it until one of them is written to.  That's how the destination ROM starts out as the source ROM.
+
+    Every handle open on the same file ID shares one Image, the same as handles on a file would.
+
+    A file can be an IPS or BPS patch of another one (its FileInfo's patchOf -- "patch of" in the
+    blueprint).  Its image is then the other file's image with the patch applied, and flushing it writes
+    a patch of the differences instead of the whole thing (see util/rompatch.h).  So an export can write
+    the whole ROM to a patch file, and an import can read a patched ROM, without knowing the difference.
+ */
+
+namespace lsh
+{
+    class RomImageCache
+    {
+    public:
+        struct Image;
+        typedef std::shared_ptr<Image>      Ptr;
+
+        struct Image
+        {
+            QString         path;
+            QByteArray      data;
+            bool            dirty = false;          // changed since it was last read or written
+            std::vector<std::pair<qint64,qint64>>   dirtyRanges;    // [start, end) of what changed, if not 'replaced'
+            bool            replaced = false;       // all of the data was replaced, so every part of it might have changed
+            QByteArray      diskData;               // the file's contents as of the last time it was read or written
+
+            void            markDirty(qint64 pos, qint64 size);
+            void            markReplaced()          { dirty = replaced = true;  dirtyRanges.clear();    }
+
+            //  The file as of the last time it was read or written, to tell if something else changed it
+            qint64          diskSize = -1;
+            QDateTime       diskModified;
+            QDateTime       diskChecked;            // when those were noted
+
+            //  For patches (see above):  the image it's a patch of, and that image's data when this one
+            //    was made from it
+            Ptr             base;
+            QByteArray      baseData;
+        };
+
+        enum class Mode
+        {
+            Existing,           // null if the file can't be read
+            Create,             // an empty image if the file doesn't exist
+            Truncate            // always an empty image.  The file isn't read at all
+        };
+
+        Ptr             open(const std::string& id, const QString& path, Mode mode, const Ptr& base = nullptr);   // 'base' for patches.  Throws if the patch doesn't apply
+
+        //  Gives the cache a file that was already read (see Project::startPrefetch), as of the given
+        //    size and modification time, noted at 'checked'.  Ignored if the file ID is already open.
+        void            preload(const std::string& id, const QString& path, const QByteArray& data, qint64 size, const QDateTime& modified, const QDateTime& checked);
+
+        bool            flush();                    // writes every dirty image.  false if any couldn't be written -- errors are logged, and those images stay dirty
+        void            clear();                    // flushes, then forgets every image
+
+    private:
+        bool            matchesDisk(Image& image) const;
+        void            noteDiskState(Image& image) const;
+        bool            writeInPlace(Image& image) const;       // false if the whole file has to be written
+        bool            writeWhole(Image& image) const;         // false on failure
+
+        std::unordered_map<std::string, Ptr>    images;
+    };
+}
+
+#endif
@@ -0,0 +1,134 @@
+
+#include "sectiontracker.h"
+
+namespace lsh
+{
+    void SectionTracker::reset(std::size_t sectionCount)
+    {
+        states.clear();
+        states.resize(sectionCount);
+        owners.clear();
+        current = noSection;
+        currentIsExport = false;
+    }
+
+    void SectionTracker::markAllDirty()
+    {
+        for(auto& i : states)
+            i.dirty = true;
+    }
+
+    void SectionTracker::beginSection(int section, bool exporting)
+    {
+        current = section;
+        currentIsExport = exporting;
+
+        // dependencies are rebuilt on every export.  The old ones are kept until the section
+        //   finishes, in case the export fails
+        if(exporting && section >= 0 && section < static_cast<int>(states.size()))
+        {
+            savedDeps.clear();
+            savedPatterns.clear();
+            states[section].deps.swap(savedDeps);
+            states[section].patterns.swap(savedPatterns);
+        }
+    }
+
+    void SectionTracker::endSection()
+    {
+        current = noSection;
+        currentIsExport = false;
+    }
+
+    void SectionTracker::sectionFailed()
+    {
+        if(current >= 0 && current < static_cast<int>(states.size()))
+        {
+            auto& st = states[current];
+            st.dirty = true;
+            if(currentIsExport)
+            {
+                // keep whatever it read before it failed, along with what it read last time
+                st.deps.insert(savedDeps.begin(), savedDeps.end());
+                st.patterns.insert(savedPatterns.begin(), savedPatterns.end());
+            }
+        }
+        endSection();
+    }
+
+    void SectionTracker::keyWritten(const std::string& key, bool changed)
+    {
+        int owner;
+        if(current != noSection)
+        {
+            owners[key] = current;
+            owner = current;
+        }
+        else
+        {
+            auto i = owners.find(key);
+            owner = (i == owners.end()) ? noSection : i->second;
+        }
+
+        // If nobody owns it, no section has ever looked at it, so nothing needs to be re-exported
+        if(changed && owner >= 0 && owner < static_cast<int>(states.size()))
+            states[owner].dirty = true;
+    }
+
+    void SectionTracker::keyRead(const std::string& key)
+    {
+        if(current < 0 || current >= static_cast<int>(states.size()))
+            return;
+
+        auto i = owners.find(key);
+        if(i == owners.end())
+        {
+            owners[key] = current;
+            return;
+        }
+
+        if(currentIsExport && i->second != current)
+            states[current].deps.insert(i->second);
+    }
+
+    void SectionTracker::patternRead(const std::string& pattern)
+    {
+        if(currentIsExport && current >= 0 && current < static_cast<int>(states.size()))
+            states[current].patterns.insert(pattern);
+    }
+
+    void SectionTracker::patternChanged(const std::string& pattern)
+    {
+        for(auto& i : states)
+        {
+            if(i.patterns.count(pattern))
+                i.dirty = true;
+        }
+    }
+
+    bool SectionTracker::isDirty(int section) const
+    {
+        if(section < 0 || section >= static_cast<int>(states.size()))
+            return true;
+        return states[section].dirty;
+    }
+
+    bool SectionTracker::needsExport(int section) const
+    {
+        if(isDirty(section))
+            return true;
+
+        for(auto& d : states[section].deps)
+        {
+            if(isDirty(d))
+                return true;
+        }
+        return false;
+    }
+
+    void SectionTracker::markExported(int section)
+    {
+        if(section >= 0 && section < static_cast<int>(states.size()))
+            states[section].dirty = false;
+    }
+}
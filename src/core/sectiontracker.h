@@ -0,0 +1,69 @@
+#ifndef LUSCH_CORE_SECTIONTRACKER_H_INCLUDED
+#define LUSCH_CORE_SECTIONTRACKER_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+
+/*
+    Tracks which blueprint sections own which keys of project data, and which sections have had their
+    data changed since they were last exported.  This lets an export skip every section whose data
+    hasn't changed.
+
+    - A key is owned by the last section which wrote it during an import or export.
+    - If a section reads a key that nobody owns yet (ie, the data was loaded from a project file), the
+      reading section claims it.
+    - While a section is exporting, every owner of every key it reads is recorded as a dependency.  If
+      any of those owners become dirty, this section has to be re-exported as well.
+    - A query (lsh.query) reads every key matching its pattern, including ones that don't exist yet.  So
+      while a section is exporting, the patterns it queries are recorded too, and any change to a key
+      matching one of them makes the section dirty -- whoever owns the key, and even if nobody does.
+
+    If a section's export fails, it stays dirty and keeps the dependencies from its previous export.
+
+    Sections are identified by their index in the blueprint's section list.  Ownership is not project
+    data -- it isn't saved and isn't part of undo/redo.
+ */
+
+namespace lsh
+{
+    class SectionTracker
+    {
+    public:
+        static const int    noSection = -1;
+
+        void                reset(std::size_t sectionCount);        // forget all owners, mark everything dirty
+        void                markAllDirty();
+
+        void                beginSection(int section, bool exporting);
+        void                endSection();
+        void                sectionFailed();                        // ends the current section, leaving it dirty
+
+        void                keyWritten(const std::string& key, bool changed);
+        void                keyRead(const std::string& key);
+        void                patternRead(const std::string& pattern);
+        void                patternChanged(const std::string& pattern);     // a key matching the pattern changed
+
+        bool                isDirty(int section) const;
+        bool                needsExport(int section) const;         // dirty, or depends on a dirty section
+        void                markExported(int section);
+
+    private:
+        struct State
+        {
+            bool            dirty = true;
+            std::set<int>   deps;               // sections this one read data from during its last export
+            std::set<std::string>   patterns;   // patterns this one queried during its last export
+        };
+
+        std::vector<State>                      states;
+        std::unordered_map<std::string, int>    owners;
+        int                                     current = noSection;
+        bool                                    currentIsExport = false;
+        std::set<int>                           savedDeps;          // the current section's deps/patterns from
+        std::set<std::string>                   savedPatterns;      //   its previous export
+    };
+}
+
+#endif
@@ -0,0 +1,179 @@
+
+#include <cmath>
+#include <limits>
+#include "valueindex.h"
+
+namespace lsh
+{
+    namespace
+    {
+        std::vector<std::string> splitKey(const std::string& key)
+        {
+            std::vector<std::string> out;
+            std::size_t start = 0;
+            while(true)
+            {
+                auto dot = key.find('.', start);
+                out.push_back( key.substr(start, dot - start) );
+                if(dot == key.npos)
+                    break;
+                start = dot + 1;
+            }
+            return out;
+        }
+
+        //  Order of the different types in an index
+        int typeRank(ProjectData::Type t)
+        {
+            switch(t)
+            {
+            case ProjectData::Type::Bool:       return 0;
+            case ProjectData::Type::Int:
+            case ProjectData::Type::Dbl:        return 1;
+            case ProjectData::Type::Str:        return 2;
+            default:                            return 3;
+            }
+        }
+
+        //  Compares an int to a double exactly.  (converting the int to a double can lose precision, which
+        //    would make the index's ordering inconsistent)  NaN is larger than every other number.
+        int compareIntDbl(ProjectData::int_t i, double d)
+        {
+            if(std::isnan(d))                                       return -1;
+            if(d >= 9223372036854775808.0)                          return -1;      // 2^63
+            if(d < -9223372036854775808.0)                          return 1;
+
+            double fl = std::floor(d);
+            auto ifl = static_cast<ProjectData::int_t>(fl);
+            if(i < ifl)                 return -1;
+            if(i > ifl)                 return 1;
+            return (d > fl) ? -1 : 0;
+        }
+
+        int compareDbl(double a, double b)
+        {
+            bool na = std::isnan(a), nb = std::isnan(b);
+            if(na || nb)                return (na ? 1 : 0) - (nb ? 1 : 0);
+            return (a < b) ? -1 : (b < a) ? 1 : 0;
+        }
+    }
+
+    ValueIndex::ValueIndex(const std::string& pat)
+        : pattern(pat)
+        , segments(splitKey(pat))
+    {
+        auto star = pattern.find('*');
+        prefix = pattern.substr(0, star);
+    }
+
+    bool ValueIndex::matches(const std::string& key) const
+    {
+        if(key.compare(0, prefix.size(), prefix) != 0)
+            return false;
+
+        std::size_t start = 0;
+        for(std::size_t i = 0; i < segments.size(); ++i)
+        {
+            auto dot = key.find('.', start);
+            bool last = (i + 1 == segments.size());
+            if(last != (dot == key.npos))
+                return false;           // key has a different number of segments
+
+            auto& seg = segments[i];
+            if(seg != "*" && key.compare(start, dot - start, seg) != 0)
+                return false;
+            start = dot + 1;
+        }
+        return true;
+    }
+
+    bool ValueIndex::isIndexable(const ProjectData& v)
+    {
+        return typeRank(v.getType()) < 3;
+    }
+
+    int ValueIndex::compare(const ProjectData& a, const ProjectData& b)
+    {
+        int ra = typeRank(a.getType()), rb = typeRank(b.getType());
+        if(ra != rb)                    return ra < rb ? -1 : 1;
+
+        switch(a.getType())
+        {
+        case ProjectData::Type::Bool:
+            return static_cast<int>(a.asBool()) - static_cast<int>(b.asBool());
+
+        case ProjectData::Type::Str:
+            return a.asString().compare( b.asString() );
+
+        case ProjectData::Type::Int:
+            if(b.getType() == ProjectData::Type::Int)
+                return (a.asInt() < b.asInt()) ? -1 : (b.asInt() < a.asInt()) ? 1 : 0;
+            return compareIntDbl(a.asInt(), b.asDbl());
+
+        case ProjectData::Type::Dbl:
+            if(b.getType() == ProjectData::Type::Int)
+                return -compareIntDbl(b.asInt(), a.asDbl());
+            return compareDbl(a.asDbl(), b.asDbl());
+        }
+
+        return 0;
+    }
+
+    bool ValueIndex::Less::operator () (const Entry& a, const Entry& b) const
+    {
+        int c = compare(a.value, b.value);
+        if(c)               return c < 0;
+        return a.key < b.key;
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //////////////////////////////////////////////////////////////////
+
+    void ValueIndex::rebuild(const DataStore& dat)
+    {
+        entries.clear();
+        byKey.clear();
+
+        //  Every matching key starts with the prefix, and those are all next to each other
+        for(auto i = dat.lowerBound(prefix); i != dat.end(); ++i)
+        {
+            if(i->first.compare(0, prefix.size(), prefix) != 0)
+                break;
+            if(matches(i->first))
+                update(i->first, &i->second);
+        }
+    }
+
+    void ValueIndex::update(const std::string& key, const ProjectData* v)
+    {
+        auto found = byKey.find(key);
+        if(found != byKey.end())
+        {
+            if(v && *v == found->second->value)
+                return;
+            entries.erase(found->second);
+            byKey.erase(found);
+        }
+
+        if(v && isIndexable(*v))
+            byKey[key] = entries.insert( Entry{ *v, key } ).first;
+    }
+
+    auto ValueIndex::query(const ProjectData* lo, bool loInclusive, const ProjectData* hi, bool hiInclusive) const -> std::vector<Result>
+    {
+        auto first = entries.begin();
+        if(lo)          first = loInclusive ? entries.lower_bound(*lo) : entries.upper_bound(*lo);
+
+        auto last = entries.end();
+        if(hi)          last = hiInclusive ? entries.upper_bound(*hi) : entries.lower_bound(*hi);
+
+        std::vector<Result> out;
+        for(auto i = first; i != last && i != entries.end(); ++i)
+        {
+            if(hi && compare(i->value, *hi) > 0)        // lo > hi
+                break;
+            out.emplace_back( i->key, i->value );
+        }
+        return out;
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef LUSCH_CORE_VALUEINDEX_H_INCLUDED
+#define LUSCH_CORE_VALUEINDEX_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <set>
+#include <unordered_map>
+#include "projectdata.h"
+#include "datastore.h"
+
+/*
+    A secondary index over project data, ordered by value rather than by key.
+
+    Each index covers every key matching a pattern.  Patterns are dot separated like keys, and a '*'
+    segment matches any single segment of a key:
+
+            "enemy.*.hp"        matches "enemy.12.hp" and "enemy.boss.hp", but not "enemy.12.stats.hp"
+
+    Only bools, numbers and strings are indexed.  Values are ordered bools first, then numbers (ints and
+    doubles compare by their numeric value), then strings.  Keys with any other value (nil, objects) are
+    simply not in the index.
+
+    The Project keeps its indexes up to date as data changes.  An index is only a cache, though -- it
+    isn't saved, and can always be rebuilt from a DataStore.
+ */
+
+namespace lsh
+{
+    class ValueIndex
+    {
+    public:
+        typedef std::pair<std::string, ProjectData>     Result;     // key, value
+
+        explicit            ValueIndex(const std::string& pattern);
+
+        const std::string&  getPattern() const      { return pattern;           }
+        std::size_t         size() const            { return entries.size();    }
+        bool                matches(const std::string& key) const;
+
+        void                rebuild(const DataStore& dat);
+        void                update(const std::string& key, const ProjectData* v);       // v is null if the key has no value
+
+        // Everything with a value between 'lo' and 'hi'.  Null bounds mean unbounded.  Results are in value order.
+        std::vector<Result> query(const ProjectData* lo, bool loInclusive, const ProjectData* hi, bool hiInclusive) const;
+
+        static bool         isIndexable(const ProjectData& v);
+        static int          compare(const ProjectData& a, const ProjectData& b);          // <0, 0, >0 -- same order as the index
+
+    private:
+        struct Entry
+        {
+            ProjectData     value;
+            std::string     key;
+        };
+        struct Less
+        {
+            typedef void    is_transparent;
+            bool operator () (const Entry& a, const Entry& b) const;
+            bool operator () (const Entry& a, const ProjectData& b) const   { return compare(a.value, b) < 0;   }
+            bool operator () (const ProjectData& a, const Entry& b) const   { return compare(a, b.value) < 0;   }
+        };
+        typedef std::set<Entry, Less>   EntrySet;
+
+        std::string                                             pattern;
+        std::vector<std::string>                                segments;   // pattern split at each '.'
+        std::string                                             prefix;     // everything before the first wildcard
+        EntrySet                                                entries;
+        std::unordered_map<std::string, EntrySet::iterator>     byKey;
+    };
+}
+
+#endif
@@ -112,7 +112,7 @@ namespace lsh
         // Otherwise, capture all the data
         for(std::size_t i = 0; i < count; ++i)
         {
-            dat[i].fileName = selectors[i]->getValue();
+            project->setFileName( i, selectors[i]->getValue() );
         }
 
         QDialog::accept();
@@ -9,6 +9,7 @@
 #include <QCloseEvent>
 #include <QCoreApplication>
 #include <QMessageBox>
+#include <QElapsedTimer>
 
 
 #include <QFileInfo>
@@ -63,6 +64,7 @@ namespace lsh
 
         buildActions();
         buildMenu();
+        connect( &project, &Project::projectStateChanged, this, &LuschApp::onProjectStateChanged );
 
         //  The editor host is the central widget for this window
         editorHost = new QMainWindow(this);
@@ -102,7 +104,12 @@ namespace lsh
         makeAction( actNewProject,  "&New Project",     QKeySequence::New,          &LuschApp::onNewProject     );
         makeAction( actOpenProject, "&Open Project",    QKeySequence::Open,         &LuschApp::onOpenProject    );
         makeAction( actSaveProject, "&Save Project",    QKeySequence::Save,         &LuschApp::onSaveProject    );
+        makeAction( actExportProject,"&Export",         QKeySequence("Ctrl+E"),     &LuschApp::onExportProject  );
         makeAction( actExit,        "E&xit",            QKeySequence::Quit,         &LuschApp::onExit           );
+        makeAction( actUndo,        "&Undo",            QKeySequence::Undo,         &LuschApp::onUndo           );
+        makeAction( actRedo,        "&Redo",            QKeySequence::Redo,         &LuschApp::onRedo           );
+        makeAction( actSaveBinary,  "Save in &Binary Format", QKeySequence(),       &LuschApp::onSaveBinary     );
+        actSaveBinary->setCheckable(true);
     }
 
     void LuschApp::buildMenu()
@@ -113,10 +120,19 @@ namespace lsh
         menu_file->addAction( actNewProject );
         menu_file->addAction( actOpenProject );
         menu_file->addAction( actSaveProject );
+        menu_file->addAction( actSaveBinary );
+        menu_file->addSeparator();
+        menu_file->addAction( actExportProject );
         menu_file->addSeparator();
         menu_file->addAction( actExit );
 
+        auto menu_edit = main->addMenu("&Edit");
+        menu_edit->addAction( actUndo );
+        menu_edit->addAction( actRedo );
+
         actSaveProject->setEnabled(false);
+        actUndo->setEnabled(false);
+        actRedo->setEnabled(false);
     }
 
     void LuschApp::onNewProject()
@@ -148,6 +164,9 @@ namespace lsh
 
         //  At this point, project and blueprint are complete enough to be usable.
         project = std::move(pj);
+        project.discardRecovery();          // anything left over from some other project with this name
+        project.startPrefetch();
+        onProjectStateChanged();
 
         //  Lastly, do a proper import -- This is OK to fail
             BEGIN_SAFE
@@ -162,8 +181,82 @@ namespace lsh
         END_SAFE
     }
 
-    void LuschApp::onOpenProject()      { /* TODO   */  }
-    void LuschApp::onSaveProject()      { /* TODO   */  }
+    void LuschApp::onOpenProject()
+    {
+        BEGIN_SAFE
+
+        // Opening a project will close our current project.  See if the user wants to save first
+        if( !promptIfDirty("Save changes before opening another project?") )
+            return;
+
+        auto x = QFileDialog::getOpenFileName(this, tr("Choose a project to open."),
+                                              QString::fromStdString(settings.lastProjectDir.getFullPath(true)),
+                                              tr("Lusch project files (*.lshpj)")
+                                             );
+        if(x.isEmpty())
+            return;
+
+        FileName projectPath = x.toStdString();
+        settings.lastProjectDir.setPathOnly(projectPath.getPathOnly());
+
+        Log::inf("\nOpening project '" + x + "'...");
+        QElapsedTimer timer;
+        timer.start();
+
+        Project pj;
+        pj.openProject( projectPath, getBlueprintRoot() );
+        project = std::move(pj);
+        project.startPrefetch();
+        onProjectStateChanged();
+        Log::inf("Project opened in " + QString::number(timer.elapsed()) + " ms\n\n");
+
+        if(project.hasRecovery())
+        {
+            auto answer = QMessageBox::question(this, "Recover changes?",
+                                                "This project was not closed properly the last time it was open.  Recover the changes that were not saved?",
+                                                QMessageBox::Yes | QMessageBox::No, QMessageBox::Yes );
+            if(answer == QMessageBox::Yes)      project.recover();
+            else                                project.discardRecovery();
+        }
+
+        END_SAFE
+    }
+
+    void LuschApp::onSaveProject()
+    {
+        project.doSave();           // finishes in the background.  See onProjectStateChanged
+    }
+
+    void LuschApp::onProjectStateChanged()
+    {
+        actSaveProject->setEnabled( project.isDirty() && !project.isSaving() );
+        actSaveBinary->setChecked( project.isSavedAsBinary() );
+        actUndo->setEnabled( project.canUndo() );
+        actRedo->setEnabled( project.canRedo() );
+    }
+
+    void LuschApp::onExportProject()
+    {
+        BEGIN_SAFE
+        project.doExport();
+        END_SAFE
+    }
+
+    void LuschApp::onUndo()
+    {
+        if(project.canUndo())       project.undo();
+    }
+
+    void LuschApp::onRedo()
+    {
+        if(project.canRedo())       project.redo();
+    }
+
+    void LuschApp::onSaveBinary()
+    {
+        project.setSaveAsBinary( actSaveBinary->isChecked() );
+        actSaveBinary->setChecked( project.isSavedAsBinary() );        // no project -- nothing to change
+    }
 
     void LuschApp::closeEvent(QCloseEvent* evt)
     {
@@ -180,7 +273,10 @@ namespace lsh
     bool LuschApp::promptIfDirty(const char* prompt)
     {
         if(!project.isDirty())
+        {
+            project.discardRecovery();      // nothing unsaved, so nothing to recover (ie, it was all undone)
             return true;
+        }
 
         auto answer = QMessageBox::warning(this, "Are you sure?", prompt,
                                            QMessageBox::Yes | QMessageBox::No | QMessageBox::Cancel,
@@ -188,8 +284,8 @@ namespace lsh
 
         switch(answer)
         {
-        case QMessageBox::No:       return true;
-        case QMessageBox::Yes:      return project.doSave();
+        case QMessageBox::No:       project.discardRecovery();      return true;
+        case QMessageBox::Yes:      return project.doSave() && project.waitForSave();
         default:                    return false;
         }
 
@@ -215,7 +311,7 @@ namespace lsh
             QFile file;
             file.setFileName( QString::fromStdString( programSettingsFileName.getFullPath(true) ) );
             if( file.open(QIODevice::ReadOnly | QIODevice::Text) )
-                settings.fromJson( json::loadFromFile(file) );
+                settings.fromJson( json::loadDocument(file) );
             ////////////////////////////////////////
             
             restoreGeometry(settings.mainWindowGeometry);
@@ -244,10 +340,16 @@ namespace lsh
 
     /////////////////////////////////////////////////////////
 
-    bool LuschApp::fileDialog_Blueprint(FileName& bpAbsolute, FileName& bpRelative)
+    FileName LuschApp::getBlueprintRoot() const
     {
         FileName root = settings.blueprintDir;
         root.makeAbsoluteWith( exeFileName );
+        return root;
+    }
+
+    bool LuschApp::fileDialog_Blueprint(FileName& bpAbsolute, FileName& bpRelative)
+    {
+        FileName root = getBlueprintRoot();
 
         auto x = QFileDialog::getOpenFileName(this, tr("Choose a blueprint for this project."),
                                               QString::fromStdString(root.getFullPath(true)),
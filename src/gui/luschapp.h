@@ -31,7 +31,12 @@ namespace lsh
         void        onNewProject();
         void        onOpenProject();
         void        onSaveProject();
+        void        onExportProject();
         void        onExit()                { close();      }
+        void        onUndo();
+        void        onRedo();
+        void        onSaveBinary();
+        void        onProjectStateChanged();
         
         ////////////////////////////////////////////////
         FileName            exeFileName;
@@ -44,7 +49,11 @@ namespace lsh
         QAction*    actNewProject;
         QAction*    actOpenProject;
         QAction*    actSaveProject;
+        QAction*    actExportProject;
         QAction*    actExit;
+        QAction*    actUndo;
+        QAction*    actRedo;
+        QAction*    actSaveBinary;
 
         void        buildActions();
         void        buildMenu();
@@ -58,6 +67,7 @@ namespace lsh
         void        saveProgramSettings();
 
         
+        FileName    getBlueprintRoot() const;
         bool        fileDialog_Blueprint(FileName& bpAbsolute, FileName& bpRelative);
         bool        fileDialog_Project(FileName& path);
     };
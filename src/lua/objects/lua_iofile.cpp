@@ -1,22 +1,44 @@
 
+#include <cstring>
+#include <algorithm>
 #include "lua_iofile.h"
 #include "log.h"
 
 namespace lsh
 {
+    namespace
+    {
+        const std::size_t       readSize = 64 * 1024;           // read from QFile at a time
+        const std::size_t       writeSize = 64 * 1024;          // written to QFile at a time (at least)
+    }
+
     void LuaIOFile::registerMemberFunctions()
     {
         LuaFunction::addMember("close", &LuaIOFile::lua_close);
+        LuaFunction::addMember("copyfrom", &LuaIOFile::lua_copyfrom);
+        LuaFunction::addMember("flush", &LuaIOFile::lua_flush);
+        LuaFunction::addMember("lines", &LuaIOFile::lua_lines);
+        LuaFunction::addMember("(next line)",   &LuaIOFile::lua_nextLine);         // the iterators file:lines returns
+        LuaFunction::addMember("(next line L)", &LuaIOFile::lua_nextLineKeep);
         LuaFunction::addMember("read",  &LuaIOFile::lua_read );
         LuaFunction::addMember("seek",  &LuaIOFile::lua_seek );
         LuaFunction::addMember("write", &LuaIOFile::lua_write);
+        LuaFunction::addMember("writecounts", &LuaIOFile::lua_writecounts);
+    }
+
+    LuaIOFile::~LuaIOFile()
+    {
+        //  The file was never closed (Lua just collected it).  There's no one to report an error to.
+        if(!flushWrites())
+            Log::err( "Unable to write file '" + file.fileName() + "':  " + file.errorString() );
     }
 
     ///////////////////////////////////////////////////////
 
     int LuaIOFile::openForLua(Lua& lua, const std::string& filepath, const FileFlags& modeinfo, bool mustopen)
     {
-        int qmode = modeinfo.binary ? 0 : QIODevice::Text;
+        //  Always binary -- see lua_iofile.h
+        int qmode = 0;
         if(modeinfo.read)           qmode |= QIODevice::ReadOnly;
         if(modeinfo.write)          qmode |= QIODevice::WriteOnly;
         if(modeinfo.trunc)          qmode |= QIODevice::Truncate;
@@ -25,8 +47,19 @@ namespace lsh
         //////////////////////
         auto outfile = std::shared_ptr<LuaIOFile>(new LuaIOFile);
         outfile->file.setFileName( QString::fromStdString(filepath) );
+        outfile->textMode = !modeinfo.binary;
         if(outfile->file.open(QIODevice::OpenModeFlag(qmode)))
         {
+            //  Read-only binary files are read straight out of a mapping (see lua_iofile.h).  If the file
+            //    can't be mapped (it's empty, or there's no address space for it), QFile is used as normal.
+            auto size = outfile->file.size();
+            if(modeinfo.read && modeinfo.binary && !modeinfo.write && !modeinfo.append && size > 0)
+            {
+                outfile->mapping = outfile->file.map(0, size);
+                if(outfile->mapping)
+                    outfile->mappedSize = size;
+            }
+
             outfile->pushToLua(lua);
             return 1;
         }
@@ -40,35 +73,300 @@ namespace lsh
         }
     }
 
+    int LuaIOFile::openForLua(Lua& lua, const RomImageCache::Ptr& image, const FileFlags& modeinfo)
+    {
+        auto outfile = std::shared_ptr<LuaIOFile>(new LuaIOFile);
+        outfile->image =            image;
+        outfile->imageReadable =    modeinfo.read;
+        outfile->imageWritable =    modeinfo.write || modeinfo.append;
+        outfile->imageAppend =      modeinfo.append;
+
+        outfile->pushToLua(lua);
+        return 1;
+    }
+
     /////////////////////////////////////////////////////////////
 
     int LuaIOFile::lua_close(Lua& lua)
     {
         lua.checkTooManyParams(1, "file:close");
 
+        std::string error;
+        if(!flushWrites())
+            error = "Failure in file:close: '" + file.errorString().toStdString() + "'";
+
+        if(mapping)
+        {
+            file.unmap(mapping);
+            mapping = nullptr;
+            mappedSize = 0;
+        }
+        image.reset();
+        memPos = 0;
+        bufPos = bufEnd = 0;
         file.close();
+
+        if(!error.empty())
+        {
+            lua_pushnil(lua);
+            lua.pushString(error);
+            return 2;
+        }
         return 0;
     }
 
+    //  file:copyfrom(src) replaces everything in this file with everything in 'src' (wherever either
+    //    of them are positioned), and moves to the start of this file.  If both are images, the data is
+    //    shared rather than copied, until one of them is written to.
+    int LuaIOFile::lua_copyfrom(Lua& lua)
+    {
+        lua.checkTooFewParams(2, "file:copyfrom");
+        lua.checkTooManyParams(2, "file:copyfrom");
+
+        auto src = LuaIOFile::getPointerFromLuaStack(lua, 2, "parameter 1 of file:copyfrom");
+        if(!isWritable())
+        {
+            lua_pushnil(lua);
+            lua_pushliteral(lua, "file:copyfrom:  File handle is not open for writing");
+            return 2;
+        }
+        if(!src->isReadable())
+        {
+            lua_pushnil(lua);
+            lua_pushliteral(lua, "file:copyfrom:  Source file handle is not open for reading");
+            return 2;
+        }
+
+        auto dat = src->allContents();
+        dropBuffer();
+        if(image)
+        {
+            image->data = dat;
+            image->markReplaced();
+            memPos = 0;
+        }
+        else if( !flushWrites() || !file.resize(0) || !file.seek(0) || !writeData(dat.constData(), dat.size()) ||
+                 !flushWrites() || !file.seek(0) )
+        {
+            lua_pushnil(lua);
+            lua.pushString( "Failure in file:copyfrom: '" + file.errorString().toStdString() + "'" );
+            return 2;
+        }
+
+        lua_settop(lua, 1);     // return this object, same as write
+        return 1;
+    }
+
+    QByteArray LuaIOFile::allContents()
+    {
+        if(image)
+            return image->data;
+        if(mapping)
+            return QByteArray(memData(), static_cast<int>(mappedSize));
+
+        flushWrites();
+        dropBuffer();
+        auto pos = file.pos();
+        file.seek(0);
+        auto dat = file.readAll();
+        file.seek(pos);
+        return dat;
+    }
+
+    //  Writes to an image work like writes to a file:  anything at the position is overwritten, and
+    //    writing past the end of the image fills the gap with zeros.
+    void LuaIOFile::writeToImage(const char* data, std::size_t size)
+    {
+        auto& dat = image->data;
+        if(imageAppend)
+            memPos = dat.size();
+        auto from = std::min<qint64>(memPos, dat.size());       // including any gap that gets filled
+        image->markDirty( from, memPos + size - from );
+        if(memPos > dat.size())
+            dat.append( QByteArray(static_cast<int>(memPos - dat.size()), '\0') );
+
+        auto replaced = std::min<qint64>( size, dat.size() - memPos );
+        dat.replace( static_cast<int>(memPos), static_cast<int>(replaced), data, static_cast<int>(size) );
+        memPos += size;
+    }
+
+    //  Text mode:  '\n' is written as "\r\n" on Windows, same as QIODevice::Text would
+    bool LuaIOFile::writeData(const char* data, std::size_t size)
+    {
+        dropBuffer();
+        if(!writesPending())
+        {
+            writeStart = file.pos();
+            writeCursor = 0;
+        }
+
+#if defined(Q_OS_WIN)
+        if(textMode && std::memchr(data, '\n', size))
+        {
+            for(auto nl = static_cast<const char*>(std::memchr(data, '\n', size)); nl; nl = static_cast<const char*>(std::memchr(data, '\n', size)))
+            {
+                auto len = static_cast<std::size_t>(nl - data);
+                bufferWrite(data, len);
+                bufferWrite("\r\n", 2);
+                data += len + 1;
+                size -= len + 1;
+            }
+            bufferWrite(data, size);
+        }
+        else
+#endif
+        if(size >= writeSize && writeBuf.empty())
+        {
+            //  Too big to be worth copying -- but it still goes where the last seek said
+            if(!flushWrites())
+                return false;
+            ++fileWrites;
+            return file.write(data, size) == static_cast<qint64>(size);
+        }
+        else
+            bufferWrite(data, size);
+
+        if(writeBuf.size() >= writeSize)
+            return flushWrites();
+        return true;
+    }
+
+    void LuaIOFile::bufferWrite(const char* data, std::size_t size)
+    {
+        //  Anything already buffered at the cursor (from a seek back into the buffer) is overwritten
+        auto end = writeCursor + size;
+        if(end > writeBuf.size())
+            writeBuf.resize(end);
+        std::memcpy( writeBuf.data() + writeCursor, data, size );
+        writeCursor = end;
+    }
+
+    bool LuaIOFile::flushWrites()
+    {
+        if(!writesPending())
+            return true;
+
+        bool ok = (file.pos() == writeStart || file.seek(writeStart));
+        if(ok && !writeBuf.empty())
+        {
+            ++fileWrites;
+            ok = file.write(writeBuf.data(), writeBuf.size()) == static_cast<qint64>(writeBuf.size());
+        }
+        if(ok && writeCursor != writeBuf.size())
+            ok = file.seek(writePos());
+
+        writeBuf.clear();
+        writeStart = -1;
+        writeCursor = 0;
+        return ok;
+    }
+
+    //  Text mode:  every '\r' is dropped, same as QIODevice::Text would
+    void LuaIOFile::pushData(Lua& lua, const char* data, std::size_t size)
+    {
+        if(!textMode || !std::memchr(data, '\r', size))
+        {
+            lua_pushlstring(lua, data, size);
+            return;
+        }
+
+        std::string out;
+        out.reserve(size);
+        for(std::size_t i = 0; i < size; ++i)
+        {
+            if(data[i] != '\r')
+                out.push_back(data[i]);
+        }
+        lua_pushlstring(lua, out.data(), out.size());
+    }
+
+    bool LuaIOFile::fillBuffer()
+    {
+        //  Keep whatever hasn't been read yet, and make room for more.  The buffer only grows if a
+        //    single line doesn't fit in it.
+        if(bufPos > 0)
+        {
+            std::memmove( readBuf.data(), readBuf.data() + bufPos, bufEnd - bufPos );
+            bufEnd -= bufPos;
+            bufPos = 0;
+        }
+        if(bufEnd == readBuf.size())
+            readBuf.resize( std::max(readBuf.size() * 2, readSize) );
+
+        auto got = file.read( readBuf.data() + bufEnd, readBuf.size() - bufEnd );
+        if(got <= 0)
+            return false;
+        bufEnd += static_cast<std::size_t>(got);
+        return true;
+    }
+
+    void LuaIOFile::dropBuffer()
+    {
+        if(bufPos < bufEnd)
+            file.seek( file.pos() - static_cast<qint64>(bufEnd - bufPos) );
+        bufPos = bufEnd = 0;
+    }
+
     int LuaIOFile::lua_seek(Lua& lua)
     {
         lua.checkTooManyParams(3, "file:seek");
 
-        if(!file.isOpen())
+        if(!isOpen())
         {
             lua_pushnil(lua);
             lua_pushliteral(lua, "file:seek:  File handle is not open");
             return 2;
         }
 
+        dropBuffer();
         std::string whence = lua.getStringParam(2, "file:seek", "cur");
         lua_Integer offset = lua.getIntParam(3, "file:seek", 0 );
 
+        qint64 pos, size;
+        if(inMemory())              { pos = memPos;         size = memSize();       }
+        else if(writesPending())    { pos = writePos();     size = std::max( file.size(), writeStart + static_cast<qint64>(writeBuf.size()) );  }
+        else                        { pos = file.pos();     size = file.size();     }
+
         if     (whence == "set")        /* no change to offset */;
-        else if(whence == "cur")        offset += file.pos();
-        else if(whence == "end")        offset += file.size();
+        else if(whence == "cur")        offset += pos;
+        else if(whence == "end")        offset += size;
         else                            throw Error( "Whence parameter '" + whence + "' is unrecognized." );
 
+        if(offset < 0)
+        {
+            lua_pushnil(lua);
+            lua_pushliteral(lua, "file:seek:  Position is before the start of the file");
+            return 2;
+        }
+
+        if(inMemory())
+        {
+            memPos = offset;
+            lua_pushinteger( lua, memPos );
+            return 1;
+        }
+
+        //  Writable files don't actually seek until they're written to or read from (see lua_iofile.h)
+        if(writesPending() && offset >= writeStart && offset <= writeStart + static_cast<qint64>(writeBuf.size()))
+        {
+            writeCursor = static_cast<std::size_t>(offset - writeStart);
+            lua_pushinteger( lua, offset );
+            return 1;
+        }
+        if(!flushWrites())
+        {
+            lua_pushnil(lua);
+            lua.pushString( "Failure in file:seek: '" + file.errorString().toStdString() + "'" );
+            return 2;
+        }
+        if(file.isWritable())
+        {
+            writeStart = offset;
+            writeCursor = 0;
+            lua_pushinteger( lua, offset );
+            return 1;
+        }
+
         if(!file.seek(offset))
         {
             lua_pushnil(lua);
@@ -82,7 +380,7 @@ namespace lsh
 
     int LuaIOFile::lua_write(Lua& lua)
     {
-        if(!file.isWritable())
+        if(!isWritable())
         {
             lua_pushnil(lua);
             lua_pushliteral(lua, "file:write:  File handle is not open for writing");
@@ -90,8 +388,6 @@ namespace lsh
         }
 
         int stk = lua_gettop(lua);
-        std::string v;
-
         for(int i = 2; i <= stk; ++i)
         {
             if(!lua_isstring(lua,i))
@@ -100,8 +396,13 @@ namespace lsh
                 lua.pushString("file:write:  Parameter " + std::to_string(i) + " is not a string or number");
                 return 2;
             }
-            v = lua.toString(i);
-            if( file.write(v.data(), v.size()) < 0)
+            //  Copied straight out of Lua's string
+            std::size_t len;
+            auto str = lua_tolstring(lua, i, &len);
+            ++luaWrites;
+            if(image)
+                writeToImage(str, len);
+            else if(!writeData(str, len))
             {
                 lua_pushnil(lua);
                 lua.pushString( "Failure in file:write: '" + file.errorString().toStdString() + "'" );
@@ -114,16 +415,87 @@ namespace lsh
         return 1;               // and return that object
     }
 
+    //  file:flush() writes out anything buffered.  Images are only written to disk at the end of the
+    //    import or export, same as before.
+    int LuaIOFile::lua_flush(Lua& lua)
+    {
+        lua.checkTooManyParams(1, "file:flush");
+
+        if(!isOpen())
+        {
+            lua_pushnil(lua);
+            lua_pushliteral(lua, "file:flush:  File handle is not open");
+            return 2;
+        }
+        if(!flushWrites() || (!image && !file.flush()))
+        {
+            lua_pushnil(lua);
+            lua.pushString( "Failure in file:flush: '" + file.errorString().toStdString() + "'" );
+            return 2;
+        }
+
+        lua_settop(lua, 1);     // return this object, same as write
+        return 1;
+    }
+
+    //  file:writecounts() returns how many strings have been given to file:write, and how many writes
+    //    to the disk that took.  For diagnostics -- an image is written in one go when the import or
+    //    export finishes, so it always has 0 of those.
+    int LuaIOFile::lua_writecounts(Lua& lua)
+    {
+        lua.checkTooManyParams(1, "file:writecounts");
+
+        lua_pushinteger(lua, luaWrites);
+        lua_pushinteger(lua, fileWrites);
+        return 2;
+    }
+
+    //  file:lines(fmt), for  'for line in file:lines() do ... end'.  fmt is "l" (the default) or "L".
+    //    Returns an iterator which reads the next line directly, rather than looking up file:read and
+    //    parsing its parameters on every line.
+    int LuaIOFile::lua_lines(Lua& lua)
+    {
+        lua.checkTooManyParams(2, "file:lines");
+
+        std::string fmt = lua.getStringParam(2, "file:lines", "l");
+        if(fmt != "l" && fmt != "L")
+            throw Error( "file:lines:  Unsupported read mode '" + fmt + "'.  Only 'l' and 'L' are supported" );
+
+        LuaFunction::pushMember<LuaIOFile>(lua, fmt == "l" ? "(next line)" : "(next line L)");
+        lua_pushvalue(lua, 1);      // the iterator's state is the file
+        return 2;
+    }
+
+    int LuaIOFile::lua_nextLine(Lua& lua)
+    {
+        if(isReadable() && flushWrites())   lua_read_l(lua, false);
+        else                                lua_pushnil(lua);
+        return 1;
+    }
+
+    int LuaIOFile::lua_nextLineKeep(Lua& lua)
+    {
+        if(isReadable() && flushWrites())   lua_read_l(lua, true);
+        else                                lua_pushnil(lua);
+        return 1;
+    }
+
     /////////////////////////////////////////////////
     //  Reading is a pain in the arse
 
     int LuaIOFile::lua_read(Lua& lua)
     {
-        if(!file.isReadable())
+        if(!isReadable())
         {
             lua_pushnil(lua);
             return 1;
         }
+        if(!flushWrites())
+        {
+            lua_pushnil(lua);
+            lua.pushString( "Failure in file:read: '" + file.errorString().toStdString() + "'" );
+            return 2;
+        }
 
         ///////////////////
         int stk = lua_gettop(lua);
@@ -167,62 +539,67 @@ namespace lsh
     bool LuaIOFile::lua_read_a(Lua& lua)
     {
         // unlike other functions, we do not push nil if at EOF
+        if(inMemory())
+        {
+            lua_pushlstring(lua, memHere(), static_cast<std::size_t>(memLeft()));
+            memPos += memLeft();
+            return false;
+        }
+
+        //  Whatever is buffered comes first
         auto dat = file.readAll();
-        lua_pushlstring(lua, dat.data(), dat.size());
+        if(bufPos < bufEnd)
+        {
+            dat.prepend( readBuf.data() + bufPos, static_cast<int>(bufEnd - bufPos) );
+            bufPos = bufEnd = 0;
+        }
+        pushData(lua, dat.constData(), dat.size());
         return false;
     }
 
     bool LuaIOFile::lua_read_l(Lua& lua, bool keepnewline)
     {
-        // Qt has a way to read individual lines, but it doesn't really document what it does with the line breaks
-        //  so I do my own thing here.
-        
         // if at EOF, push nil, always
-        if(file.atEnd())
+        if(inMemory() ? memAtEnd() : fileAtEnd())
         {
             lua_pushnil(lua);
             return true;
         }
 
-        //  I peek then read here... which is redundant... but because of BS text file mode, seeking
-        //    is unreliable.
-        
-        std::string out;
-        constexpr qint64 bufsize = 100;
-        char buffer[bufsize];
-
-        while(true)
+        if(inMemory())
         {
-            // peek in 'bufsize' sized chunks
-            auto bytes = file.peek(buffer, bufsize);
+            auto left = static_cast<std::size_t>(memLeft());
+            auto nl = static_cast<const char*>( std::memchr(memHere(), '\n', left) );
+            auto len = nl ? static_cast<std::size_t>(nl - memHere()) : left;
 
-            if(!bytes)      // no more data = we're done
-                break;
-
-            // Search for the newline
-            int nl;
-            for(nl = 0; (nl < bytes) && (buffer[nl] != '\n'); ++nl) {}
+            lua_pushlstring(lua, memHere(), (nl && keepnewline) ? len + 1 : len);
+            memPos += nl ? len + 1 : len;
+            return false;
+        }
 
-            if(nl == bytes)     // we didn't find a newline
+        //  Look for the newline in what's buffered, reading more until it's found.  Each byte is only
+        //    looked at once, however long the line is.
+        std::size_t scanned = 0;            // bytes after bufPos already known not to be a newline
+        while(true)
+        {
+            auto line = readBuf.data() + bufPos;
+            auto nl = static_cast<const char*>( std::memchr(line + scanned, '\n', bufEnd - bufPos - scanned) );
+            if(nl)
             {
-                bytes = file.read(buffer, nl);
-                if(bytes < 0)  bytes = 0;
-
-                out.append( buffer, static_cast<std::size_t>(bytes) );
+                auto len = static_cast<std::size_t>(nl - line);
+                pushData(lua, line, keepnewline ? len + 1 : len);
+                bufPos += len + 1;
+                return false;
             }
-            else                // we DID find a newline
-            {
-                bytes = file.read(buffer, nl+1);
-                if(!keepnewline)
-                    --bytes;
-                if(bytes < 0)  bytes = 0;
-                
-                out.append( buffer, static_cast<std::size_t>(bytes) );
+
+            scanned = bufEnd - bufPos;
+            if(!fillBuffer())
                 break;
-            }
         }
 
-        lua.pushString(out);
+        //  The last line of the file, with no newline
+        pushData(lua, readBuf.data() + bufPos, bufEnd - bufPos);
+        bufPos = bufEnd = 0;
         return false;
     }
 
@@ -233,7 +610,7 @@ namespace lsh
         // otherwise, if num > 0, read that many bytes and push as a string
         // The Lua spec does not indicate what happens if num<0, so treat it same as zero
 
-        if(file.atEnd())
+        if(inMemory() ? memAtEnd() : fileAtEnd())
         {
             lua_pushnil(lua);
             return true;
@@ -243,10 +620,30 @@ namespace lsh
             lua_pushliteral(lua, "");
             return false;
         }
+        else if(inMemory())
+        {
+            auto len = std::min<qint64>(num, memLeft());
+            lua_pushlstring(lua, memHere(), static_cast<std::size_t>(len));
+            memPos += len;
+            return false;
+        }
+        else if(static_cast<std::size_t>(num) <= readSize)
+        {
+            while(bufEnd - bufPos < static_cast<std::size_t>(num) && fillBuffer()) {}
+
+            auto len = std::min<std::size_t>(num, bufEnd - bufPos);
+            pushData(lua, readBuf.data() + bufPos, len);
+            bufPos += len;
+            return false;
+        }
         else
         {
-            auto dat = file.read(num);
-            lua_pushlstring(lua, dat.data(), dat.size());
+            //  Big reads skip the buffer
+            auto buffered = bufEnd - bufPos;
+            QByteArray dat( readBuf.data() + bufPos, static_cast<int>(buffered) );
+            bufPos = bufEnd = 0;
+            dat += file.read( num - buffered );
+            pushData(lua, dat.constData(), dat.size());
             return false;
         }
     }
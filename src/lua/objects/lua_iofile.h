@@ -5,12 +5,33 @@
         Since I don't want scripts to be able to open/modify any file on the user's HD, I'm
     reimplementing the standard IO library that comes with Lua.  This class represents
     file objects ( obtained via io.open() )
+
+        Files listed in the blueprint, opened in binary mode (which is how ROMs are opened), are images
+    held by the project (see core/romimagecache.h) rather than QFiles.  Other files opened read-only in
+    binary mode are memory mapped when possible.  Either way, reads and seeks on those never touch
+    QFile:  they're served straight out of memory, and every read is a single lua_pushlstring, however
+    large.
+
+        Everything else is read through QFile, but in large blocks into a buffer here, rather than a bit
+    at a time.  Lines are found in that buffer with memchr.  Files are always opened in binary mode, so
+    positions in the buffer are positions in the file -- text mode's line ending translation is done
+    here instead (see pushData and writeData).
+
+        Writes through QFile are collected in a buffer here and written in large blocks.  Each
+    file:write argument is copied straight out of Lua into it.  A seek doesn't touch the file either:
+    seeking inside what's buffered just moves around in the buffer (so patching a record that was
+    just written costs nothing), and seeking anywhere else writes out the buffer and starts a new one
+    at the new position -- the seek and the write that follows it become one positioned write.  The
+    buffer is written out when it fills up, before any read, on file:flush, and on close.
+    file:writecounts() gives how many strings were written from Lua, and how many writes that took.
  */
 
 #include "core/fileinfo.h"
+#include "core/romimagecache.h"
 #include "lua/lua_function.h"
 #include "lua_object.h"
 #include <memory>
+#include <vector>
 #include <QFile>
 
 namespace lsh
@@ -18,22 +39,74 @@ namespace lsh
     class LuaIOFile : public LuaUserData<LuaIOFile>
     {
     public:
+                            ~LuaIOFile();           // writes out anything still buffered
+
         static int          openForLua(Lua& lua, const std::string& filepath, const FileFlags& mode, bool mustopen);
+        static int          openForLua(Lua& lua, const RomImageCache::Ptr& image, const FileFlags& mode);
 
         static const char*  getClassName()                  { return "io:file";     }
         static void         registerMemberFunctions();
 
     private:
         int     lua_close(Lua& lua);
+        int     lua_copyfrom(Lua& lua);
+        int     lua_flush(Lua& lua);
+        int     lua_lines(Lua& lua);
+        int     lua_nextLine(Lua& lua);
+        int     lua_nextLineKeep(Lua& lua);
         int     lua_read(Lua& lua);
         int     lua_seek(Lua& lua);
         int     lua_write(Lua& lua);
+        int     lua_writecounts(Lua& lua);
         
         bool    lua_read_a(Lua& lua);
         bool    lua_read_l(Lua& lua, bool keepnewline);
         bool    lua_read_num(Lua& lua, lua_Integer num);
 
-        QFile   file;
+        bool        isOpen() const          { return image || file.isOpen();                        }
+        bool        isReadable() const      { return image ? imageReadable : file.isReadable();     }
+        bool        isWritable() const      { return image ? imageWritable : file.isWritable();     }
+        QByteArray  allContents();
+        void        writeToImage(const char* data, std::size_t size);
+        bool        writeData(const char* data, std::size_t size);          // to 'file'
+        void        pushData(Lua& lua, const char* data, std::size_t size); // as read from the file (text mode drops '\r's)
+
+        //  Reading through QFile (see above)
+        bool        fillBuffer();           // reads more of the file after what's already buffered.  false at the end
+        void        dropBuffer();           // moves the file back to the first unread byte, before anything else uses it
+        bool        fileAtEnd()             { return bufPos == bufEnd && file.atEnd();              }
+
+        //  Writing through QFile (see above)
+        void        bufferWrite(const char* data, std::size_t size);
+        bool        flushWrites();          // writes out the buffer and moves the file to where it should be.  false on failure
+        bool        writesPending() const   { return writeStart >= 0;                               }
+        qint64      writePos() const        { return writeStart + static_cast<qint64>(writeCursor); }
+
+        //  Files in memory -- either a mapping or an image (see above)
+        bool        inMemory() const        { return mapping || image;                              }
+        const char* memData() const         { return image ? image->data.constData() : reinterpret_cast<const char*>(mapping);  }
+        qint64      memSize() const         { return image ? image->data.size() : mappedSize;       }
+        bool        memAtEnd() const        { return memPos >= memSize();                           }
+        qint64      memLeft() const         { return memAtEnd() ? 0 : memSize() - memPos;           }
+        const char* memHere() const         { return memData() + memPos;                            }
+
+        QFile               file;
+        bool                textMode = false;
+        std::vector<char>   readBuf;
+        std::size_t         bufPos = 0;             // first unread byte in readBuf
+        std::size_t         bufEnd = 0;
+        std::vector<char>   writeBuf;
+        qint64              writeStart = -1;        // where writeBuf goes in the file.  -1 if nothing is pending
+        std::size_t         writeCursor = 0;        // the file's position, in writeBuf
+        qint64              luaWrites = 0;          // strings given to file:write
+        qint64              fileWrites = 0;         // writes made to the file for them
+        uchar*              mapping = nullptr;      // null if the file isn't mapped
+        qint64              mappedSize = 0;
+        RomImageCache::Ptr  image;                  // null if the file isn't an image
+        bool                imageReadable = false;
+        bool                imageWritable = false;
+        bool                imageAppend = false;
+        qint64              memPos = 0;             // can be past the end, same as a seek on a file
 
         LuaIOFile() = default;
         LuaIOFile(const LuaIOFile&) = delete;
@@ -35,6 +35,7 @@
  */
 
 #include <memory>
+#include <string>
 #include <stdexcept>
 #include "lua/lua_wrapper.h"
 #include "lua/lua_function.h"
@@ -49,6 +50,11 @@ namespace lsh
         
         virtual                 ~LuaObject() = default;
         void                    pushToLua(Lua& lua);
+
+        //  Objects which can be saved as part of a project return a storage tag, and write themselves
+        //    out with saveToBinary (see core/objectsidecar.h).  Objects with no tag are not saved.
+        virtual const char*     getStorageTag() const   { return nullptr;       }
+        virtual std::string     saveToBinary() const    { return std::string(); }
         
         static Ptr getPointerFromLuaStack(Lua& lua, int index, const char* errname)
         {
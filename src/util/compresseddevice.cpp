@@ -0,0 +1,183 @@
+
+#include <cstring>
+#include <algorithm>
+#include "compresseddevice.h"
+#include "error.h"
+
+namespace lsh
+{
+    namespace
+    {
+        const char              fileSignature[8] = { 'L', 'S', 'H', 'Z', 'I', 'P', '\r', '\n' };
+        const std::uint32_t     fileVersion = 1;
+        const std::size_t       frameSize = 256 * 1024;         // uncompressed bytes per frame
+
+        void putLE32(char* out, std::uint32_t v)
+        {
+            for(int i = 0; i < 4; ++i)
+                out[i] = static_cast<char>( (v >> (i*8)) & 0xFF );
+        }
+
+        std::uint32_t getLE32(const char* p)
+        {
+            std::uint32_t v = 0;
+            for(int i = 3; i >= 0; --i)
+                v = (v << 8) | static_cast<uchar>(p[i]);
+            return v;
+        }
+    }
+
+    CompressedDevice::CompressedDevice(QIODevice& dev, int lvl)
+        : device(dev)
+        , level(lvl)
+    {
+    }
+
+    bool CompressedDevice::isCompressed(QIODevice& dev)
+    {
+        auto start = dev.peek( sizeof(fileSignature) );
+        return start.size() == sizeof(fileSignature) && !std::memcmp(start.constData(), fileSignature, sizeof(fileSignature));
+    }
+
+    bool CompressedDevice::open(OpenMode mode)
+    {
+        char hdr[sizeof(fileSignature) + 4];
+
+        if(mode == QIODevice::WriteOnly)
+        {
+            std::memcpy(hdr, fileSignature, sizeof(fileSignature));
+            putLE32(hdr + sizeof(fileSignature), fileVersion);
+            if(device.write(hdr, sizeof(hdr)) != sizeof(hdr))
+            {
+                setErrorString( device.errorString() );
+                return false;
+            }
+            pending.reserve(frameSize);
+        }
+        else if(mode == QIODevice::ReadOnly)
+        {
+            if(device.read(hdr, sizeof(hdr)) != sizeof(hdr) || std::memcmp(hdr, fileSignature, sizeof(fileSignature)))
+            {
+                setErrorString( "Not a compressed file" );
+                return false;
+            }
+            if(getLE32(hdr + sizeof(fileSignature)) > fileVersion)
+            {
+                setErrorString( "Compressed file was written by a newer version of Lusch" );
+                return false;
+            }
+        }
+        else
+            return false;
+
+        return QIODevice::open(mode);
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //  Writing
+
+    qint64 CompressedDevice::writeData(const char* data, qint64 size)
+    {
+        qint64 done = 0;
+        while(done < size)
+        {
+            auto n = std::min<qint64>( size - done, frameSize - pending.size() );
+            pending.append(data + done, static_cast<std::size_t>(n));
+            done += n;
+
+            if(pending.size() >= frameSize && !writeFrame())
+                return -1;
+        }
+        return done;
+    }
+
+    bool CompressedDevice::writeFrame()
+    {
+        if(pending.empty())
+            return true;
+
+        auto packed = qCompress( reinterpret_cast<const uchar*>(pending.data()), static_cast<int>(pending.size()), level );
+        pending.clear();
+
+        char len[4];
+        putLE32(len, static_cast<std::uint32_t>(packed.size()));
+        if( device.write(len, 4) != 4 || device.write(packed.constData(), packed.size()) != packed.size() )
+        {
+            setErrorString( device.errorString() );
+            return false;
+        }
+        return true;
+    }
+
+    void CompressedDevice::finish()
+    {
+        char end[4] = {};
+        if( !writeFrame() || device.write(end, 4) != 4 )
+            throw Error( "Error writing compressed data:  " + errorString() );
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //  Reading
+
+    qint64 CompressedDevice::readData(char* data, qint64 maxSize)
+    {
+        qint64 done = 0;
+        while(done < maxSize)
+        {
+            if(framePos >= frame.size())
+            {
+                if(ended)
+                    break;
+                if(!readFrame())
+                    return -1;
+                continue;
+            }
+
+            auto n = std::min<qint64>( maxSize - done, frame.size() - framePos );
+            std::memcpy(data + done, frame.constData() + framePos, static_cast<std::size_t>(n));
+            framePos += static_cast<int>(n);
+            done += n;
+        }
+        return done;
+    }
+
+    bool CompressedDevice::readFrame()
+    {
+        frame.clear();
+        framePos = 0;
+
+        char len[4];
+        if(device.read(len, 4) != 4)
+        {
+            setErrorString( "Compressed file is incomplete" );
+            return false;
+        }
+
+        auto size = getLE32(len);
+        if(!size)
+        {
+            ended = true;
+            return true;
+        }
+
+        auto packed = device.read(size);
+        if(packed.size() != static_cast<int>(size))
+        {
+            setErrorString( "Compressed file is incomplete" );
+            return false;
+        }
+
+        frame = qUncompress(packed);
+        if(frame.isEmpty())
+        {
+            setErrorString( "Compressed file is damaged" );
+            return false;
+        }
+        return true;
+    }
+
+    qint64 CompressedDevice::bytesAvailable() const
+    {
+        return (frame.size() - framePos) + QIODevice::bytesAvailable();
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef LUSCH_UTIL_COMPRESSEDDEVICE_H_INCLUDED
+#define LUSCH_UTIL_COMPRESSEDDEVICE_H_INCLUDED
+
+#include <QIODevice>
+#include <QByteArray>
+#include <string>
+
+/*
+    A QIODevice which compresses everything written to it (or decompresses everything read from it)
+    on the way to/from another device.  This is for writing and reading large files without having to
+    hold the whole thing in memory -- qCompress on its own needs the entire file in one buffer.
+
+    The data is split into frames, each of which is compressed separately with qCompress (zlib).  Only
+    one frame is ever in memory.  File layout:
+
+        - 8 byte signature, 4 byte version (little endian)
+        - any number of frames:  4 byte size (little endian), then that many bytes of qCompress output
+        - a 4 byte size of zero, marking the end
+
+    A file without the end marker was never finished, and reading it fails rather than returning
+    partial data.
+
+    Writing:
+            CompressedDevice zip(file, level);
+            zip.open(QIODevice::WriteOnly);     // writes the header
+            ... write to zip ...
+            zip.finish();                       // writes the last frame.  Required!
+
+    Reading:
+            if(CompressedDevice::isCompressed(file))
+            {
+                CompressedDevice unzip(file);
+                unzip.open(QIODevice::ReadOnly);
+                ... read from unzip ...
+            }
+
+    This is a sequential device -- no seeking.
+
+    As for levels:  project data compresses very well, and level 1 gets nearly all of it.  The armor
+    blueprint scaled up to 1M values, saved as a pretty printed json tree, goes from 20.3MB to 3.8MB at
+    level 1 (save time about doubles), 3.3MB at level 6 (4x), and 3.1MB at level 9 (18x).  Opening
+    takes about the same time at any level -- decompressing is cheap next to parsing.
+ */
+
+namespace lsh
+{
+    class CompressedDevice : public QIODevice
+    {
+    public:
+                        CompressedDevice(QIODevice& device, int level = -1);    // level is as qCompress:  -1 for default, else 1-9
+
+        static bool     isCompressed(QIODevice& device);        // peeks at the start of an open device
+
+        bool            open(OpenMode mode) override;           // either ReadOnly or WriteOnly
+        void            finish();                               // writing:  writes whatever is left, and the end marker.  Errors are thrown
+
+        bool            isSequential() const override           { return true;      }
+        qint64          bytesAvailable() const override;
+
+    protected:
+        qint64          readData(char* data, qint64 maxSize) override;
+        qint64          writeData(const char* data, qint64 size) override;
+
+    private:
+        bool            writeFrame();
+        bool            readFrame();
+
+        QIODevice&      device;
+        int             level;
+
+        std::string     pending;                // writing:  data waiting to be compressed
+        QByteArray      frame;                  // reading:  the current decompressed frame
+        int             framePos = 0;
+        bool            ended = false;          // reading:  the end marker has been read
+    };
+}
+
+#endif
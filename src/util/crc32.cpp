@@ -0,0 +1,61 @@
+
+#include "crc32.h"
+
+namespace lsh
+{
+    namespace
+    {
+        struct Tables
+        {
+            std::uint32_t   t[8][256];
+
+            Tables()
+            {
+                for(std::uint32_t i = 0; i < 256; ++i)
+                {
+                    auto c = i;
+                    for(int b = 0; b < 8; ++b)
+                        c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+                    t[0][i] = c;
+                }
+
+                //  t[n][i] is the CRC of byte i followed by n zero bytes
+                for(std::uint32_t i = 0; i < 256; ++i)
+                {
+                    for(int n = 1; n < 8; ++n)
+                        t[n][i] = (t[n-1][i] >> 8) ^ t[0][ t[n-1][i] & 0xFF ];
+                }
+            }
+        };
+
+        const Tables& tables()
+        {
+            static const Tables tbl;
+            return tbl;
+        }
+    }
+
+    std::uint32_t crc32(const void* data, std::size_t size, std::uint32_t crc)
+    {
+        auto& t = tables().t;
+        auto p = static_cast<const unsigned char*>(data);
+        crc = ~crc;
+
+        //  8 bytes at a time.  Read as two little endian words, whatever the machine is.
+        for(; size >= 8; size -= 8, p += 8)
+        {
+            std::uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<std::uint32_t>(p[3]) << 24));
+            std::uint32_t hi =        p[4] | (p[5] << 8) | (p[6] << 16) | (static_cast<std::uint32_t>(p[7]) << 24);
+            crc =   t[7][ lo         & 0xFF] ^ t[6][(lo >>  8) & 0xFF] ^
+                    t[5][(lo >> 16)  & 0xFF] ^ t[4][ lo >> 24        ] ^
+                    t[3][ hi         & 0xFF] ^ t[2][(hi >>  8) & 0xFF] ^
+                    t[1][(hi >> 16)  & 0xFF] ^ t[0][ hi >> 24        ];
+        }
+
+        //  Then whatever's left
+        for(; size; --size, ++p)
+            crc = t[0][(crc ^ *p) & 0xFF] ^ (crc >> 8);
+
+        return ~crc;
+    }
+}
@@ -0,0 +1,199 @@
+
+#include <algorithm>
+#include "jsondocument.h"
+
+namespace picojson
+{
+    namespace doc
+    {
+        namespace
+        {
+            const std::size_t       firstBlockSize = 64 * 1024;
+            const std::size_t       maxBlockSize = 4 * 1024 * 1024;     // blocks double in size until they get this big
+
+            //  FNV-1a
+            inline std::uint32_t hashKey(const char* s, std::size_t len)
+            {
+                std::uint32_t h = 2166136261u;
+                for(std::size_t i = 0; i < len; ++i)
+                    h = (h ^ static_cast<unsigned char>(s[i])) * 16777619u;
+                return h;
+            }
+        }
+
+        void value::wrongType()
+        {
+            throw lsh::Error("Json value is not of the requested type");
+        }
+
+        const member* object::find(const char* key, std::size_t len) const
+        {
+            if(index)
+            {
+                for(auto h = hashKey(key, len) & indexMask; index[h]; h = (h + 1) & indexMask)
+                {
+                    auto m = items + index[h] - 1;
+                    if(m->first.equals(key, len))
+                        return m;
+                }
+                return end();
+            }
+
+            //  Small objects are just searched.  Backwards, so a repeated key finds the last one
+            for(auto m = end(); m != begin(); )
+            {
+                --m;
+                if(m->first.equals(key, len))
+                    return m;
+            }
+            return end();
+        }
+
+        //////////////////////////////////////////////////////////////////
+        //  Building
+
+        //  Objects and arrays are collected here while they're being read, since anything inside them
+        //    gets finished first.  Then they're copied to the arena in one piece.
+        struct document::Scratch
+        {
+            std::vector<member>     members;
+            std::vector<value>      items;
+        };
+
+        document::document(QIODevice& device)
+        {
+            lsh::JsonStreamReader in(device);
+            read(in);
+        }
+
+        document::document(const char* first, const char* last)
+        {
+            lsh::JsonStreamReader in(first, last);
+            read(in);
+        }
+
+        void document::read(lsh::JsonStreamReader& in)
+        {
+            if(in.next() != Token::BeginObject)
+                throw lsh::Error("Json file does not contain a root object.");
+
+            Scratch tmp;
+            readObject(in, tmp, *this);
+            in.next();              // throws if there's anything after the end
+        }
+
+        void document::readValue(lsh::JsonStreamReader& in, Scratch& tmp, Token tok, value& out)
+        {
+            switch(tok)
+            {
+            case Token::Null:           out.kind = null_type;                                   break;
+            case Token::Bool:           out.kind = boolean_type;    out.b = in.boolValue();     break;
+            case Token::Int:            out.kind = int64_type;      out.i = in.intValue();      break;
+            case Token::Double:         out.kind = number_type;     out.d = in.doubleValue();   break;
+            case Token::String:         out.kind = string_type;     out.s = copyString(in.stringValue());   break;
+            case Token::BeginArray:     out.kind = array_type;      out.a = array();    readArray(in, tmp, out.a);      break;
+            case Token::BeginObject:    out.kind = object_type;     out.o = object();   readObject(in, tmp, out.o);     break;
+            default:
+                throw lsh::Error( "json::doc::document::readValue called with no value" );
+            }
+        }
+
+        void document::readObject(lsh::JsonStreamReader& in, Scratch& tmp, object& out)
+        {
+            auto start = tmp.members.size();
+            for(auto t = in.next(); t != Token::EndObject; t = in.next())
+            {
+                member m;
+                m.first = copyString(in.key());     // before reading the value, which might have keys of its own
+                readValue(in, tmp, t, m.second);
+                tmp.members.push_back(m);
+            }
+
+            auto count = tmp.members.size() - start;
+            if(count)
+            {
+                auto p = static_cast<member*>( allocate(count * sizeof(member), alignof(member)) );
+                std::copy( tmp.members.begin() + start, tmp.members.end(), p );
+                out.items = p;
+                out.count = static_cast<std::uint32_t>(count);
+                tmp.members.resize(start);
+            }
+            if(count >= object::hashedSize)
+                buildIndex(out);
+        }
+
+        void document::readArray(lsh::JsonStreamReader& in, Scratch& tmp, array& out)
+        {
+            auto start = tmp.items.size();
+            for(auto t = in.next(); t != Token::EndArray; t = in.next())
+            {
+                value v;
+                readValue(in, tmp, t, v);
+                tmp.items.push_back(v);
+            }
+
+            auto count = tmp.items.size() - start;
+            if(count)
+            {
+                auto p = static_cast<value*>( allocate(count * sizeof(value), alignof(value)) );
+                std::copy( tmp.items.begin() + start, tmp.items.end(), p );
+                out.items = p;
+                out.count = static_cast<std::uint32_t>(count);
+                tmp.items.resize(start);
+            }
+        }
+
+        void document::buildIndex(object& obj)
+        {
+            std::uint32_t size = 1;
+            while(size < obj.count * 2)
+                size <<= 1;
+
+            auto index = static_cast<std::uint32_t*>( allocate(size * sizeof(std::uint32_t), alignof(std::uint32_t)) );
+            std::fill( index, index + size, 0 );
+            obj.index = index;
+            obj.indexMask = size - 1;
+
+            for(std::uint32_t i = 0; i < obj.count; ++i)
+            {
+                auto& key = obj.items[i].first;
+                auto h = hashKey(key.data(), key.size()) & obj.indexMask;
+                while(index[h] && !obj.items[index[h] - 1].first.equals(key.data(), key.size()))
+                    h = (h + 1) & obj.indexMask;
+                index[h] = i + 1;           // a repeated key replaces the earlier one
+            }
+        }
+
+        //////////////////////////////////////////////////////////////////
+        //  The arena
+
+        void* document::allocate(std::size_t size, std::size_t align)
+        {
+            auto p = reinterpret_cast<char*>( (reinterpret_cast<std::uintptr_t>(pos) + align - 1) & ~(align - 1) );
+            if(!pos || p > blockEnd || size > static_cast<std::size_t>(blockEnd - p))
+            {
+                nextBlockSize = std::min( std::max(nextBlockSize * 2, firstBlockSize), maxBlockSize );
+                auto blockSize = std::max( nextBlockSize, size + align );
+                blocks.emplace_back( new char[blockSize] );
+                pos = blocks.back().get();
+                blockEnd = pos + blockSize;
+                p = reinterpret_cast<char*>( (reinterpret_cast<std::uintptr_t>(pos) + align - 1) & ~(align - 1) );
+            }
+            pos = p + size;
+            return p;
+        }
+
+        string document::copyString(const std::string& s)
+        {
+            string out;
+            if(!s.empty())
+            {
+                auto p = static_cast<char*>( allocate(s.size() + 1, 1) );
+                std::memcpy( p, s.data(), s.size() + 1 );
+                out.ptr = p;
+                out.len = static_cast<std::uint32_t>(s.size());
+            }
+            return out;
+        }
+    }
+}
@@ -0,0 +1,691 @@
+
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <cinttypes>
+#include <clocale>
+#include <algorithm>
+#include "jsonstreamreader.h"
+
+#if defined(__AVX2__)
+    #include <immintrin.h>
+    #define LUSCH_JSON_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define LUSCH_JSON_SSE2
+#endif
+
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+namespace lsh
+{
+    namespace
+    {
+        const std::size_t       readSize = 64 * 1024;           // bytes read from a device at a time
+        const std::size_t       blocksPerScan = 256;            // 64 byte blocks scanned at a time (when the input is all in memory)
+
+        //////////////////////////////////////////////////////////////////
+        //  Character classes for a 64 byte block, one bit per byte
+
+        struct BlockBits
+        {
+            std::uint64_t       quote = 0;
+            std::uint64_t       backslash = 0;
+            std::uint64_t       structural = 0;         // {}[]:,
+            std::uint64_t       space = 0;
+            std::uint64_t       control = 0;            // below 0x20 (not allowed in strings)
+        };
+
+#if defined(LUSCH_JSON_AVX2)
+        typedef __m256i         Lane;
+        const int               laneSize = 32;
+        inline Lane             load(const char* p)             { return _mm256_loadu_si256( reinterpret_cast<const __m256i*>(p) );    }
+        inline Lane             splat(char c)                   { return _mm256_set1_epi8(c);                   }
+        inline Lane             either(Lane a, Lane b)          { return _mm256_or_si256(a, b);                 }
+        inline Lane             equal(Lane a, char c)           { return _mm256_cmpeq_epi8(a, splat(c));        }
+        inline Lane             atMost(Lane a, char c)          { return _mm256_cmpeq_epi8(_mm256_max_epu8(a, splat(c)), splat(c));   }
+        inline std::uint64_t    bits(Lane a)                    { return static_cast<std::uint32_t>( _mm256_movemask_epi8(a) );        }
+#elif defined(LUSCH_JSON_SSE2)
+        typedef __m128i         Lane;
+        const int               laneSize = 16;
+        inline Lane             load(const char* p)             { return _mm_loadu_si128( reinterpret_cast<const __m128i*>(p) );       }
+        inline Lane             splat(char c)                   { return _mm_set1_epi8(c);                      }
+        inline Lane             either(Lane a, Lane b)          { return _mm_or_si128(a, b);                    }
+        inline Lane             equal(Lane a, char c)           { return _mm_cmpeq_epi8(a, splat(c));           }
+        inline Lane             atMost(Lane a, char c)          { return _mm_cmpeq_epi8(_mm_max_epu8(a, splat(c)), splat(c));         }
+        inline std::uint64_t    bits(Lane a)                    { return static_cast<std::uint16_t>( _mm_movemask_epi8(a) );           }
+#endif
+
+        inline BlockBits classify(const char* p)
+        {
+            BlockBits out;
+#if defined(LUSCH_JSON_AVX2) || defined(LUSCH_JSON_SSE2)
+            for(int i = 0; i < 64; i += laneSize)
+            {
+                Lane v = load(p + i);
+                Lane lower = either(v, splat(0x20));            // '[' -> '{', ']' -> '}'
+
+                out.quote       |= bits( equal(v, '"') ) << i;
+                out.backslash   |= bits( equal(v, '\\') ) << i;
+                out.structural  |= bits( either( either(equal(lower, '{'), equal(lower, '}')), either(equal(v, ':'), equal(v, ',')) ) ) << i;
+                out.space       |= bits( either( either(equal(v, ' '), equal(v, '\t')), either(equal(v, '\n'), equal(v, '\r')) ) ) << i;
+                out.control     |= bits( atMost(v, 0x1F) ) << i;
+            }
+#else
+            for(int i = 0; i < 64; ++i)
+            {
+                std::uint64_t bit = std::uint64_t(1) << i;
+                switch(p[i])
+                {
+                case '"':   out.quote |= bit;           break;
+                case '\\':  out.backslash |= bit;       break;
+                case '{': case '}': case '[': case ']': case ':': case ',':
+                            out.structural |= bit;      break;
+                case ' ':   out.space |= bit;           break;
+                case '\t': case '\n': case '\r':
+                            out.space |= bit;           out.control |= bit;     break;
+                default:
+                    if(static_cast<unsigned char>(p[i]) < 0x20)
+                        out.control |= bit;
+                    break;
+                }
+            }
+#endif
+            return out;
+        }
+
+        //  Each bit set to the xor of itself and every bit below it.  Given the quote bits, this gives the
+        //    bits which are inside of a string (including the opening quote, but not the closing one).
+        inline std::uint64_t prefixXor(std::uint64_t x)
+        {
+            x ^= x << 1;
+            x ^= x << 2;
+            x ^= x << 4;
+            x ^= x << 8;
+            x ^= x << 16;
+            x ^= x << 32;
+            return x;
+        }
+
+        inline int lowestBit(std::uint64_t x)
+        {
+#if defined(_MSC_VER) && defined(_M_X64)
+            unsigned long i;
+            _BitScanForward64(&i, x);
+            return static_cast<int>(i);
+#elif defined(__GNUC__)
+            return __builtin_ctzll(x);
+#else
+            int i = 0;
+            while(!(x & 1))     { x >>= 1;  ++i;    }
+            return i;
+#endif
+        }
+
+        inline bool isDelimiter(char c)
+        {
+            switch(c)
+            {
+            case ' ': case '\t': case '\n': case '\r':
+            case '{': case '}': case '[': case ']': case ':': case ',': case '"':
+                return true;
+            }
+            return false;
+        }
+
+        //  Every power of 10 that a double holds exactly
+        const double exactPowers[] = {
+            1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        //  Numbers whose digits fit in a double's mantissa, and whose power of 10 is exact, come out of one
+        //    multiply or divide already correctly rounded -- ie, exactly what strtod gives.  Most numbers
+        //    are like that.  Anything else returns false, and is left to strtod.
+        bool simpleDouble(const char* p, const char* end, double& out)
+        {
+            bool negative = (*p == '-');
+            if(negative)
+                ++p;
+
+            std::uint64_t mantissa = 0;
+            int digits = 0;
+            int exponent = 0;
+            auto first = p;
+            for(; p != end && *p >= '0' && *p <= '9'; ++p, ++digits)
+                mantissa = (mantissa * 10) + (*p - '0');
+            if(p == first)
+                return false;
+
+            if(p != end && *p == '.')
+            {
+                first = ++p;
+                for(; p != end && *p >= '0' && *p <= '9'; ++p, ++digits, --exponent)
+                    mantissa = (mantissa * 10) + (*p - '0');
+                if(p == first)
+                    return false;
+            }
+
+            if(p != end && (*p == 'e' || *p == 'E'))
+            {
+                bool negExp = false;
+                if(++p != end && (*p == '+' || *p == '-'))
+                    negExp = (*p++ == '-');
+                int e = 0;
+                first = p;
+                for(; p != end && *p >= '0' && *p <= '9' && e < 1000; ++p)
+                    e = (e * 10) + (*p - '0');
+                if(p == first)
+                    return false;
+                exponent += negExp ? -e : e;
+            }
+
+            if(p != end && !isDelimiter(*p))
+                return false;
+            if(digits > 19 || mantissa > (std::uint64_t(1) << 53) || exponent < -22 || exponent > 22)
+                return false;
+
+            double v = static_cast<double>(mantissa);
+            v = (exponent < 0) ? (v / exactPowers[-exponent]) : (v * exactPowers[exponent]);
+            out = negative ? -v : v;
+            return true;
+        }
+
+        inline int hexDigit(char c)
+        {
+            if(c >= '0' && c <= '9')        return c - '0';
+            if(c >= 'a' && c <= 'f')        return c - 'a' + 10;
+            if(c >= 'A' && c <= 'F')        return c - 'A' + 10;
+            return -1;
+        }
+
+        //  The 4 hex digits of a \u escape, or -1 if they aren't there
+        int quadHex(const char* p, const char* last)
+        {
+            if(last - p < 4)
+                return -1;
+            int out = 0;
+            for(int i = 0; i < 4; ++i)
+            {
+                int d = hexDigit(p[i]);
+                if(d < 0)
+                    return -1;
+                out = (out << 4) | d;
+            }
+            return out;
+        }
+
+        void appendUtf8(std::string& out, int ch)
+        {
+            if(ch < 0x80)
+                out.push_back( static_cast<char>(ch) );
+            else
+            {
+                if(ch < 0x800)
+                    out.push_back( static_cast<char>(0xC0 | (ch >> 6)) );
+                else
+                {
+                    if(ch < 0x10000)
+                        out.push_back( static_cast<char>(0xE0 | (ch >> 12)) );
+                    else
+                    {
+                        out.push_back( static_cast<char>(0xF0 | (ch >> 18)) );
+                        out.push_back( static_cast<char>(0x80 | ((ch >> 12) & 0x3F)) );
+                    }
+                    out.push_back( static_cast<char>(0x80 | ((ch >> 6) & 0x3F)) );
+                }
+                out.push_back( static_cast<char>(0x80 | (ch & 0x3F)) );
+            }
+        }
+    }
+
+    JsonStreamReader::JsonStreamReader(QIODevice& dev)
+    {
+        //  Files are read straight out of a memory mapping, if they can be mapped
+        auto file = dynamic_cast<QFileDevice*>(&dev);
+        if(file)
+        {
+            auto pos = file->pos();
+            auto len = file->size() - pos;
+            if(len > 0)
+                mapping = file->map(pos, len);
+            if(mapping)
+            {
+                mappedFile = file;
+                data = reinterpret_cast<const char*>(mapping);
+                size = static_cast<std::size_t>(len);
+                return;
+            }
+        }
+
+        device = &dev;
+        eof = false;
+    }
+
+    JsonStreamReader::JsonStreamReader(const char* first, const char* last)
+        : data(first)
+        , size(last - first)
+    {
+    }
+
+    JsonStreamReader::~JsonStreamReader()
+    {
+        if(mapping)
+            mappedFile->unmap(mapping);
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //  Scanning
+
+    bool JsonStreamReader::loadMore()
+    {
+        std::copy( tokens.begin() + cur, tokens.begin() + tokenCount, tokens.begin() );
+        tokenCount -= cur;
+        cur = 0;
+
+        auto end = base + size;
+        if(scanned + 64 <= end)
+        {
+            auto count = std::min<std::uint64_t>( (end - scanned) / 64, blocksPerScan );
+            for(; count > 0; --count, scanned += 64)
+                scanBlock( at(scanned), scanned );
+            return true;
+        }
+
+        if(!eof)
+        {
+            readMore();
+            return true;
+        }
+
+        if(scanned < end)
+        {
+            //  The last partial block.  Padding it with spaces doesn't change anything
+            char last[64];
+            std::memset(last, ' ', sizeof(last));
+            std::memcpy(last, at(scanned), static_cast<std::size_t>(end - scanned));
+            scanBlock( last, scanned );
+            scanned = end;
+            return true;
+        }
+
+        return false;
+    }
+
+    void JsonStreamReader::readMore()
+    {
+        //  Nothing before the next token is needed any more
+        auto keep = tokenCount ? tokens.front() : scanned;
+        auto drop = static_cast<std::size_t>(keep - base);
+        droppedLines += std::count( buffer.begin(), buffer.begin() + drop, '\n' );
+        buffer.erase( buffer.begin(), buffer.begin() + drop );
+        base = keep;
+
+        auto had = buffer.size();
+        buffer.resize( had + readSize );
+        auto got = device->read( buffer.data() + had, static_cast<qint64>(readSize) );
+        if(got < 0)
+            throw Error( "Error reading file:  " + device->errorString() );
+
+        buffer.resize( had + static_cast<std::size_t>(got) );
+        eof = (got == 0);
+        data = buffer.data();
+        size = buffer.size();
+    }
+
+    //  Finds the tokens in a 64 byte block.  A token is the start of a string, a number, or true/false/null,
+    //    or a structural character -- or the end of a string, so that it's known where each string ends.
+    void JsonStreamReader::scanBlock(const char* block, std::uint64_t pos)
+    {
+        auto b = classify(block);
+
+        //  Escaped characters are the ones after an odd length run of backslashes.  Runs starting on an
+        //    odd bit are found by adding them to the backslash bits:  the carry out of each run lands just
+        //    after it, on the escaped character if the run was odd.  Runs starting on even bits are the
+        //    same with the roles of the bits flipped.  A run can carry over from the previous block.
+        const std::uint64_t evenBits = 0x5555555555555555ULL;
+        std::uint64_t backslash = b.backslash & ~prevEscaped;
+        std::uint64_t followsEscape = (backslash << 1) | prevEscaped;
+        std::uint64_t oddStarts = backslash & ~evenBits & ~followsEscape;
+        std::uint64_t evenCarries = oddStarts + backslash;
+        prevEscaped = (evenCarries < oddStarts) ? 1 : 0;
+        std::uint64_t escaped = (evenBits ^ (evenCarries << 1)) & followsEscape;
+
+        std::uint64_t quote = b.quote & ~escaped;
+        std::uint64_t inString = prefixXor(quote) ^ prevInString;
+        prevInString = static_cast<std::uint64_t>( static_cast<std::int64_t>(inString) >> 63 );
+
+        if(b.control & inString)
+            fail( pos + lowestBit(b.control & inString) );
+
+        //  Numbers and true/false/null are runs of anything else.  Only the start of each is a token
+        std::uint64_t scalar = ~(b.structural | b.space | b.quote);
+        std::uint64_t scalarStart = scalar & ~((scalar << 1) | prevScalar);
+        prevScalar = scalar >> 63;
+
+        std::uint64_t found = ((b.structural | scalarStart) & ~inString) | quote;
+        if(tokens.size() < tokenCount + 64)
+            tokens.resize( tokens.size() + tokenCount + 64 );
+
+        auto out = tokens.data() + tokenCount;
+        while(found)
+        {
+            *out++ = pos + lowestBit(found);
+            found &= found - 1;
+        }
+        tokenCount = out - tokens.data();
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //  Tokens
+
+    bool JsonStreamReader::findToken(std::size_t ahead)
+    {
+        while(cur + ahead >= tokenCount)
+        {
+            if(!loadMore())
+                return false;
+        }
+        return true;
+    }
+
+    JsonStreamReader::Token JsonStreamReader::next()
+    {
+        if(levels.empty())
+        {
+            if(!started)
+            {
+                started = true;
+                return readItem();
+            }
+            if(haveToken(0))
+                fail( tokens[cur] );            // more after the end of the top level value
+            return Token::End;
+        }
+
+        if(!haveToken(0))
+            fail( base + size );
+
+        char c = *at(tokens[cur]);
+        bool isObject = levels.back().isObject;
+        if(c == (isObject ? '}' : ']'))
+        {
+            ++cur;
+            levels.pop_back();
+            return isObject ? Token::EndObject : Token::EndArray;
+        }
+
+        if(!levels.back().empty)
+        {
+            if(c != ',')
+                fail( tokens[cur] );
+            ++cur;
+        }
+        levels.back().empty = false;
+
+        if(isObject)
+        {
+            if(!haveToken(0) || *at(tokens[cur]) != '"')
+                fail( haveToken(0) ? tokens[cur] : base + size );
+            readString(keyText);
+
+            if(!haveToken(0) || *at(tokens[cur]) != ':')
+                fail( haveToken(0) ? tokens[cur] : base + size );
+            ++cur;
+        }
+
+        return readItem();
+    }
+
+    JsonStreamReader::Token JsonStreamReader::readItem()
+    {
+        if(!haveToken(0))
+            fail( base + size );
+
+        switch( *at(tokens[cur]) )
+        {
+        case '{':   ++cur;  levels.push_back( Level{true, true} );      return Token::BeginObject;
+        case '[':   ++cur;  levels.push_back( Level{false, true} );     return Token::BeginArray;
+        case '"':   readString(strVal);                                 return Token::String;
+        }
+        return readScalar();
+    }
+
+    JsonStreamReader::Token JsonStreamReader::readScalar()
+    {
+        haveToken(1);                   // so that all of this one has been read
+        auto pos = tokens[cur];
+        const char* first = at(pos);
+        const char* end = data + size;
+        ++cur;
+
+        //  Plain ints are by far the most common, so those are done directly
+        {
+            bool negative = (*first == '-');
+            const char* digits = first + (negative ? 1 : 0);
+            const char* p = digits;
+            std::int64_t v = 0;
+            for(; p != end && p - digits < 19 && *p >= '0' && *p <= '9'; ++p)
+                v = (v * 10) + (*p - '0');
+            if(p != digits && p - digits <= 18 && (p == end || isDelimiter(*p)))
+            {
+                intVal = negative ? -v : v;
+                return Token::Int;
+            }
+        }
+
+        if((*first == '-' || (*first >= '0' && *first <= '9')) && simpleDouble(first, end, dblVal))
+            return Token::Double;
+
+        const char* last = first;
+        while(last != end && !isDelimiter(*last))
+            ++last;
+
+        auto len = static_cast<std::size_t>(last - first);
+        switch(*first)
+        {
+        case 't':
+            if(len == 4 && !std::memcmp(first, "true", 4))      { boolVal = true;   return Token::Bool;     }
+            fail(pos);
+        case 'f':
+            if(len == 5 && !std::memcmp(first, "false", 5))     { boolVal = false;  return Token::Bool;     }
+            fail(pos);
+        case 'n':
+            if(len == 4 && !std::memcmp(first, "null", 4))      return Token::Null;
+            fail(pos);
+        }
+
+        //  Anything else that's a number.  picojson takes every character that could be part of a number,
+        //    then tries it as an int and then as a double.
+        if(*first != '-' && (*first < '0' || *first > '9'))
+            fail(pos);
+
+        bool integral = true;
+        for(auto p = first; p != last; ++p)
+        {
+            switch(*p)
+            {
+            case '0': case '1': case '2': case '3': case '4': case '5': case '6': case '7': case '8': case '9':
+            case '+': case '-':
+                break;
+            case '.': case 'e': case 'E':
+                integral = false;
+                break;
+            default:
+                fail(pos);
+            }
+        }
+
+        std::string num(first, last);
+#if PICOJSON_USE_LOCALE
+        auto point = num.find('.');
+        if(point != std::string::npos)
+            num.replace(point, 1, std::localeconv()->decimal_point);
+#endif
+        char* endp;
+        if(integral)
+        {
+            errno = 0;
+            auto v = std::strtoimax(num.c_str(), &endp, 10);
+            if(errno == 0 && endp == num.c_str() + num.size())
+            {
+                intVal = v;
+                return Token::Int;
+            }
+        }
+        dblVal = std::strtod(num.c_str(), &endp);
+        if(endp != num.c_str() + num.size() || !std::isfinite(dblVal))
+            fail(pos);
+        return Token::Double;
+    }
+
+    void JsonStreamReader::readString(std::string& out)
+    {
+        //  The scan found both ends of the string -- there's no need to look for the closing quote
+        if(!haveToken(1))
+            fail( base + size );
+        auto open = tokens[cur];
+        auto close = tokens[cur + 1];
+        cur += 2;
+
+        const char* first = at(open) + 1;
+        const char* last = at(close);
+        auto escape = static_cast<const char*>( std::memchr(first, '\\', last - first) );
+        if(!escape)
+            out.assign(first, last);
+        else
+        {
+            out.assign(first, escape);
+            unescape(escape, last, out);
+        }
+    }
+
+    void JsonStreamReader::unescape(const char* p, const char* last, std::string& out)
+    {
+        while(p != last)
+        {
+            if(*p != '\\')
+            {
+                auto escape = static_cast<const char*>( std::memchr(p, '\\', last - p) );
+                if(!escape)
+                    escape = last;
+                out.append(p, escape);
+                p = escape;
+                continue;
+            }
+
+            auto pos = base + (p - data);
+            ++p;            // never the end -- the closing quote would have been escaped
+            switch(*p++)
+            {
+            case '"':   out.push_back('"');     break;
+            case '\\':  out.push_back('\\');    break;
+            case '/':   out.push_back('/');     break;
+            case 'b':   out.push_back('\b');    break;
+            case 'f':   out.push_back('\f');    break;
+            case 'n':   out.push_back('\n');    break;
+            case 'r':   out.push_back('\r');    break;
+            case 't':   out.push_back('\t');    break;
+            case 'u':
+                {
+                    int ch = quadHex(p, last);
+                    if(ch < 0)
+                        fail(pos);
+                    p += 4;
+                    if(ch >= 0xD800 && ch <= 0xDFFF)
+                    {
+                        //  Surrogate pair -- the second half has to come right after
+                        if(ch >= 0xDC00 || last - p < 2 || p[0] != '\\' || p[1] != 'u')
+                            fail(pos);
+                        int second = quadHex(p + 2, last);
+                        if(second < 0xDC00 || second > 0xDFFF)
+                            fail(pos);
+                        p += 6;
+                        ch = (((ch - 0xD800) << 10) | ((second - 0xDC00) & 0x3FF)) + 0x10000;
+                    }
+                    appendUtf8(out, ch);
+                }
+                break;
+            default:
+                fail(pos);
+            }
+        }
+    }
+
+    void JsonStreamReader::fail(std::uint64_t pos)
+    {
+        //  Same message as picojson, though this only shows the start of the rest of the line (a
+        //    compact json file is all one line)
+        auto p = at( std::min(pos, base + size) );
+        auto end = data + size;
+        auto line = droppedLines + std::count(data, p, '\n') + 1;
+
+        std::string msg = "syntax error at line " + std::to_string(line) + " near: ";
+        for(int shown = 0; p != end && *p != '\n' && shown < 40; ++p)
+        {
+            if(static_cast<unsigned char>(*p) >= ' ')
+            {
+                msg.push_back(*p);
+                ++shown;
+            }
+        }
+        throw Error(msg);
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //  Whole values
+
+    void JsonStreamReader::readValue(Token tok, picojson::value& out)
+    {
+        //  picojson values can't be moved, so everything is built in place
+        switch(tok)
+        {
+        case Token::Null:       picojson::value().swap(out);            break;
+        case Token::Bool:       picojson::value(boolVal).swap(out);     break;
+        case Token::Int:        picojson::value(intVal).swap(out);      break;
+        case Token::Double:     picojson::value(dblVal).swap(out);      break;
+        case Token::String:
+            picojson::value(picojson::string_type, false).swap(out);
+            out.get<std::string>().swap(strVal);
+            break;
+        case Token::BeginArray:
+            {
+                picojson::value(picojson::array_type, false).swap(out);
+                auto& arr = out.get<picojson::array>();
+                for(auto t = next(); t != Token::EndArray; t = next())
+                {
+                    arr.emplace_back();
+                    readValue(t, arr.back());
+                }
+            }
+            break;
+        case Token::BeginObject:
+            {
+                //  Members are almost always in order (picojson writes them that way), which makes
+                //    hinting at the end nearly free.  A repeated name replaces the earlier one, as in picojson.
+                picojson::value(picojson::object_type, false).swap(out);
+                auto& obj = out.get<picojson::object>();
+                for(auto t = next(); t != Token::EndObject; t = next())
+                {
+                    auto i = obj.emplace_hint( obj.end(), keyText, picojson::value() );
+                    readValue(t, i->second);
+                }
+            }
+            break;
+        default:
+            throw Error( "JsonStreamReader::readValue called with no value" );
+        }
+    }
+
+    void JsonStreamReader::skipValue(Token tok)
+    {
+        if(tok != Token::BeginObject && tok != Token::BeginArray)
+            return;
+
+        auto depth = levels.size();
+        while(levels.size() >= depth)
+            next();
+    }
+}
@@ -0,0 +1,129 @@
+#ifndef LUSCH_UTIL_JSONSTREAMREADER_H_INCLUDED
+#define LUSCH_UTIL_JSONSTREAMREADER_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <QIODevice>
+#include <QFileDevice>
+#include "picojson.h"
+#include "error.h"
+
+/*
+    Reads json one token at a time, much faster than picojson does.  This is the reading counterpart to
+    JsonStreamWriter.
+
+    picojson looks at every character of the input individually.  This instead works in two passes:
+
+        - The input is scanned 64 bytes at a time with SIMD instructions (AVX2 if the build enables it,
+            otherwise SSE2, with a plain C++ fallback for anything else).  This finds the position of
+            every string, number, and structural character ({}[]:,) -- taking escapes into account, so
+            nothing inside a string is mistaken for structure -- without branching on each character.
+        - next() then hops straight from one of those positions to the next.  Whitespace is never
+            looked at again, and strings are copied out in one go.
+
+    The scan only runs a little ahead of next(), so the positions it finds never take up much memory.
+    Files are read straight out of a memory mapping when possible.  Other devices are read through a
+    small buffer, so memory use doesn't depend on the size of the input there either.
+
+    Values come out exactly as picojson would produce them:  numbers without a fraction or exponent
+    that fit in 64 bits are ints, anything else is a double.  Syntax errors are thrown as lsh::Error,
+    with the same "syntax error at line X near: ..." message that picojson gives.
+
+            JsonStreamReader in(file);
+            if(in.next() != JsonStreamReader::Token::BeginObject)   ...
+            for(auto tok = in.next(); tok != JsonStreamReader::Token::EndObject; tok = in.next())
+            {
+                //  in.key() is the name of this member
+                if(tok == JsonStreamReader::Token::Int)     foo(in.key(), in.intValue());
+                else                                        in.readValue(tok, someValue);       // the whole thing, whatever it is
+            }
+
+    For just turning text into a json::value, see json::fastParse in qtjson.h.
+
+    As for speed:  on a 16.7MB project file (1M values), the scan runs at about 1.6 GB/s with SSE2, 1.8
+    with AVX2, and 0.35 without either.  Reading every token takes about 40ms, where picojson takes 75
+    (0.44 GB/s vs 0.22).  Building a json::value is mostly std::map work, so that's only about 20% faster.
+    Numbers with more digits than a double holds exactly (most fractions picojson writes have 17) still
+    go through strtod, like picojson, and are the slowest thing here.
+ */
+
+namespace lsh
+{
+    class JsonStreamReader
+    {
+    public:
+        enum class Token { Null, Bool, Int, Double, String, BeginObject, EndObject, BeginArray, EndArray, End };
+
+        explicit            JsonStreamReader(QIODevice& device);                    // reads from the device's current position
+                            JsonStreamReader(const char* first, const char* last);
+                            ~JsonStreamReader();
+
+                            JsonStreamReader(const JsonStreamReader&) = delete;
+        JsonStreamReader&   operator = (const JsonStreamReader&) = delete;
+
+        Token               next();                                 // End once the top level value is done
+        const std::string&  key() const             { return keyText;   }       // if the last token is a member of an object, its name
+
+        bool                boolValue() const       { return boolVal;   }
+        std::int64_t        intValue() const        { return intVal;    }
+        double              doubleValue() const     { return dblVal;    }
+        std::string&        stringValue()           { return strVal;    }       // can be moved from
+
+        void                readValue(Token tok, picojson::value& out);     // 'tok' (just returned by next) as json.  Objects and arrays are read through to their end
+        void                skipValue(Token tok);                   // same, but the value is thrown away
+
+    private:
+        struct Level
+        {
+            bool    isObject;
+            bool    empty;
+        };
+
+        //  Scanning
+        bool                loadMore();                             // finds more tokens, reading more input if needed.  false at the end of the input
+        void                readMore();
+        void                scanBlock(const char* block, std::uint64_t pos);
+
+        //  Tokens
+        bool                haveToken(std::size_t ahead)            { return cur + ahead < tokenCount || findToken(ahead);  }   // makes sure the token 'ahead' of the current one has been found
+        bool                findToken(std::size_t ahead);
+        const char*         at(std::uint64_t pos) const             { return data + (pos - base);   }
+        Token               readItem();
+        Token               readScalar();
+        void                readString(std::string& out);
+        void                unescape(const char* p, const char* last, std::string& out);
+        [[noreturn]] void   fail(std::uint64_t pos);
+
+        //  The input
+        QIODevice*                  device = nullptr;               // null if all of the input is in memory
+        QFileDevice*                mappedFile = nullptr;
+        uchar*                      mapping = nullptr;
+        std::vector<char>           buffer;                         // when reading from 'device'
+        const char*                 data = nullptr;                 // what we have of the input
+        std::size_t                 size = 0;
+        std::uint64_t               base = 0;                       // position of 'data' in the input
+        std::size_t                 droppedLines = 0;               // newlines in the input before 'data'
+        bool                        eof = true;
+
+        //  Scan state
+        std::uint64_t               scanned = 0;                    // everything before this position has been scanned
+        std::uint64_t               prevEscaped = 0;                // carried from one 64 byte block to the next
+        std::uint64_t               prevInString = 0;
+        std::uint64_t               prevScalar = 0;
+        std::vector<std::uint64_t>  tokens;                         // positions found by the scan (only the first tokenCount are used)
+        std::size_t                 tokenCount = 0;
+        std::size_t                 cur = 0;                        // next entry in 'tokens' to read
+
+        //  Parse state
+        std::vector<Level>          levels;
+        bool                        started = false;
+        std::string                 keyText;
+        std::string                 strVal;
+        std::int64_t                intVal = 0;
+        double                      dblVal = 0;
+        bool                        boolVal = false;
+    };
+}
+
+#endif
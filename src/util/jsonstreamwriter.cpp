@@ -0,0 +1,184 @@
+
+#include <iterator>
+#include "jsonstreamwriter.h"
+
+namespace lsh
+{
+    namespace
+    {
+        const std::size_t       bufferSize = 64 * 1024;
+    }
+
+    JsonStreamWriter::JsonStreamWriter(QIODevice& dev, bool prettify)
+        : device(dev)
+        , pretty(prettify)
+    {
+        buffer.reserve(bufferSize + 1024);
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //  Structure
+
+    void JsonStreamWriter::beginObject()
+    {
+        beforeValue();
+        buffer += '{';
+        levels.push_back( Level{true, true} );
+    }
+
+    void JsonStreamWriter::endObject()
+    {
+        bool empty = levels.back().empty;
+        levels.pop_back();
+        if(pretty && !empty)
+            newline(levels.size());
+        buffer += '}';
+        afterValue();
+    }
+
+    void JsonStreamWriter::beginArray()
+    {
+        beforeValue();
+        buffer += '[';
+        levels.push_back( Level{false, true} );
+    }
+
+    void JsonStreamWriter::endArray()
+    {
+        bool empty = levels.back().empty;
+        levels.pop_back();
+        if(pretty && !empty)
+            newline(levels.size());
+        buffer += ']';
+        afterValue();
+    }
+
+    void JsonStreamWriter::key(const std::string& name)
+    {
+        auto& lv = levels.back();
+        if(!lv.empty)
+            buffer += ',';
+        lv.empty = false;
+        if(pretty)
+            newline(levels.size());
+
+        json::serialize_str(name, std::back_inserter(buffer));
+        buffer += pretty ? ": " : ":";
+    }
+
+    //  Members of an object already had their separator written by key()
+    void JsonStreamWriter::beforeValue()
+    {
+        if(levels.empty() || levels.back().isObject)
+            return;
+
+        auto& lv = levels.back();
+        if(!lv.empty)
+            buffer += ',';
+        lv.empty = false;
+        if(pretty)
+            newline(levels.size());
+    }
+
+    void JsonStreamWriter::afterValue()
+    {
+        if(levels.empty() && pretty)
+            buffer += '\n';             // picojson ends a pretty root value with a newline
+        if(buffer.size() >= bufferSize)
+            writeBuffer();
+    }
+
+    void JsonStreamWriter::newline(std::size_t depth)
+    {
+        buffer += '\n';
+        buffer.append(depth * json::INDENT_WIDTH, ' ');
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //  Values
+
+    void JsonStreamWriter::null()
+    {
+        beforeValue();
+        buffer += "null";
+        afterValue();
+    }
+
+    void JsonStreamWriter::value(bool v)
+    {
+        beforeValue();
+        buffer += v ? "true" : "false";
+        afterValue();
+    }
+
+    void JsonStreamWriter::value(std::int64_t v)
+    {
+        beforeValue();
+        buffer += std::to_string(v);
+        afterValue();
+    }
+
+    void JsonStreamWriter::value(double v)
+    {
+        beforeValue();
+        buffer += json::value(v).to_str();          // picojson has its own rules for formatting doubles
+        afterValue();
+    }
+
+    void JsonStreamWriter::value(const std::string& v)
+    {
+        beforeValue();
+        json::serialize_str(v, std::back_inserter(buffer));
+        afterValue();
+    }
+
+    void JsonStreamWriter::value(const json::value& v)
+    {
+        if(!v.is<json::object>() && !v.is<json::array>())
+        {
+            beforeValue();
+            if(v.is<std::string>())     json::serialize_str(v.get<std::string>(), std::back_inserter(buffer));
+            else                        buffer += v.to_str();
+            afterValue();
+            return;
+        }
+
+        //  Let picojson write the whole thing, then indent it to wherever we are now.  Newlines inside
+        //    strings are escaped, so every newline in the output is formatting.
+        beforeValue();
+        auto str = v.serialize(pretty);
+        if(pretty)
+        {
+            str.pop_back();             // the trailing newline for root values
+            std::string indent(levels.size() * json::INDENT_WIDTH, ' ');
+            for(auto c : str)
+            {
+                buffer += c;
+                if(c == '\n')
+                    buffer += indent;
+            }
+        }
+        else
+            buffer += str;
+        afterValue();
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //////////////////////////////////////////////////////////////////
+
+    void JsonStreamWriter::writeBuffer()
+    {
+        if(buffer.empty())
+            return;
+
+        auto written = device.write(buffer.data(), buffer.size());
+        if(written != static_cast<qint64>(buffer.size()))
+            throw Error( "Error writing json data:  " + device.errorString() );
+        buffer.clear();
+    }
+
+    void JsonStreamWriter::finish()
+    {
+        writeBuffer();
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef LUSCH_UTIL_JSONSTREAMWRITER_H_INCLUDED
+#define LUSCH_UTIL_JSONSTREAMWRITER_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <QIODevice>
+#include "util/qtjson.h"
+
+/*
+    Writes json directly to a QIODevice, one piece at a time, without ever building the whole thing in
+    memory.  Everything goes through a small buffer, so memory use doesn't depend on how much is
+    written.
+
+    The output is byte-for-byte what picojson's serialize() would produce for the same value (including
+    its pretty printing), so files written either way are interchangeable.  Note that means object
+    members must be written in sorted order if that matters to you -- picojson objects are std::maps.
+
+    Usage mirrors the structure of the json:
+
+            JsonStreamWriter out(file, pretty);
+            out.beginObject();
+                out.key("foo");     out.value(5);
+                out.key("bar");     out.beginArray();   out.value("x");     out.endArray();
+            out.endObject();
+            out.finish();
+
+    Errors writing to the device are thrown as lsh::Error.
+ */
+
+namespace lsh
+{
+    class JsonStreamWriter
+    {
+    public:
+                    JsonStreamWriter(QIODevice& device, bool pretty);
+
+        void        beginObject();
+        void        endObject();
+        void        beginArray();
+        void        endArray();
+        void        key(const std::string& name);           // name of the next member of the current object
+
+        void        null();
+        void        value(bool v);
+        void        value(std::int64_t v);
+        void        value(double v);
+        void        value(const std::string& v);
+        void        value(const char* v)                    { value(std::string(v));    }
+        void        value(const json::value& v);            // any json value, including entire objects/arrays
+
+        void        finish();                               // write out anything still buffered
+
+    private:
+        struct Level
+        {
+            bool    isObject;
+            bool    empty;
+        };
+
+        void        beforeValue();
+        void        afterValue();
+        void        newline(std::size_t depth);
+        void        writeBuffer();
+
+        QIODevice&          device;
+        bool                pretty;
+        std::string         buffer;
+        std::vector<Level>  levels;
+    };
+}
+
+#endif
@@ -3,6 +3,8 @@
 
 #include "error.h"
 #include "picojson.h"
+#include "jsonstreamreader.h"
+#include "jsondocument.h"
 #include <string>
 #include <QIODevice>
 #include <QByteArray>
@@ -19,25 +21,46 @@ namespace json = picojson;
 
 namespace picojson
 {
+    //  Parsing starts at the device's current position.  Files are read straight out of a memory mapping
+    //    (see jsonstreamreader.h).
     inline json::object loadFromFile(QIODevice& file)
     {
-        // TODO - maybe iterate over the file in place instead of reading it into a giant buffer?
-
-        auto data = file.readAll();
-        if(data.isEmpty())
-            throw lsh::Error("Unknown error occurred when trying to read json file");
-
-        std::string err;
         json::value output;
-        json::parse( output, data.begin(), data.end(), &err );
-
-        if(!err.empty())
-            throw lsh::Error(err);
+        lsh::JsonStreamReader reader(file);
+        reader.readValue( reader.next(), output );
+        reader.next();              // throws if there's anything after the end
 
         if(!output.is<json::object>())
             throw lsh::Error("Json file does not contain a root object.");
 
-        return output.get<json::object>();
+        json::object obj;
+        obj.swap( output.get<json::object>() );
+        return obj;
+    }
+
+    //  Same as loadFromFile, but read into a json::doc::document -- much cheaper to build and free, but
+    //    read-only (see jsondocument.h)
+    inline doc::document loadDocument(QIODevice& file)
+    {
+        return doc::document(file);
+    }
+
+    //  Same as json::parse for text that's already in memory, but faster (see jsonstreamreader.h).  Unlike
+    //    json::parse, anything other than whitespace after the value is an error.
+    inline const char* fastParse(value& out, const char* first, const char* last, std::string* err)
+    {
+        try
+        {
+            lsh::JsonStreamReader reader(first, last);
+            reader.readValue( reader.next(), out );
+            reader.next();
+            return last;
+        }
+        catch(std::exception& e)
+        {
+            if(err)     *err = e.what();
+            return first;
+        }
     }
 
     inline void saveToFile(const json::object& obj, QIODevice& file, bool pretty)
@@ -53,14 +76,15 @@ namespace picojson
         return (v = value( T() )).get<T>();
     }
 
-    template <typename T>
-    inline bool readField(const object& obj, const std::string& name, std::function<void(const T&)> func)
+    //  'obj' can be a json::object or a json::doc::object
+    template <typename T, typename Object>
+    inline bool readField(const Object& obj, const std::string& name, std::function<void(const T&)> func)
     {
         auto i = obj.find(name);
-        if(i == obj.end())              return false;
-        if(!i->second.is<T>())          return false;
+        if(i == obj.end())                      return false;
+        if(!i->second.template is<T>())         return false;
 
-        func(i->second.get<T>());
+        func(i->second.template get<T>());
         return true;
     }
 }
@@ -0,0 +1,132 @@
+
+#include <future>
+#include <cstring>
+#include <cstdio>
+#include <QCryptographicHash>
+#include <QIODevice>
+#include "romfingerprint.h"
+#include "crc32.h"
+
+namespace lsh
+{
+    namespace
+    {
+        const char          inesSignature[4] = { 'N', 'E', 'S', '\x1A' };
+        const int           inesHeaderSize = 16;
+        const int           parallelSize = 256 * 1024;      // smaller than this, a thread isn't worth starting
+        const int           streamChunkSize = 4 * 1024 * 1024;
+
+        std::string hexCrc(std::uint32_t crc)
+        {
+            char buf[9];
+            std::snprintf(buf, sizeof(buf), "%08X", crc);
+            return buf;
+        }
+
+        //  The CRC32 and SHA-1 of everything fed to it, one piece at a time
+        class Hasher
+        {
+        public:
+            explicit Hasher(const RomFingerprint& wanted)
+                : wanted(wanted)
+                , sha1(QCryptographicHash::Sha1)
+            {}
+
+            void add(const char* p, qint64 size)
+            {
+                std::future<std::uint32_t> crcFuture;
+                if(wanted.hasCrc32)
+                {
+                    auto policy = (size >= parallelSize && !wanted.sha1.isEmpty()) ? std::launch::async : std::launch::deferred;
+                    auto prev = crc;
+                    crcFuture = std::async( policy, [p, size, prev] { return lsh::crc32(p, static_cast<std::size_t>(size), prev); } );
+                }
+                if(!wanted.sha1.isEmpty())
+                    sha1.addData(p, static_cast<int>(size));
+                if(wanted.hasCrc32)
+                    crc = crcFuture.get();
+                total += size;
+            }
+
+            RomFingerprint result()
+            {
+                RomFingerprint out;
+                out.size = total;
+                if(!wanted.sha1.isEmpty())
+                    out.sha1 = sha1.result().toHex();
+                if(wanted.hasCrc32)
+                {
+                    out.crc32 = crc;
+                    out.hasCrc32 = true;
+                }
+                return out;
+            }
+
+        private:
+            const RomFingerprint&   wanted;
+            QCryptographicHash      sha1;
+            std::uint32_t           crc = 0;
+            qint64                  total = 0;
+        };
+
+        bool hasInesHeader(const char* p, qint64 size)
+        {
+            return size >= inesHeaderSize && !std::memcmp(p, inesSignature, sizeof(inesSignature));
+        }
+    }
+
+    RomFingerprint RomFingerprint::compute(const QByteArray& data, const RomFingerprint& wanted, bool skipInesHeader)
+    {
+        const char* p = data.constData();
+        qint64 size = data.size();
+        if(skipInesHeader && hasInesHeader(p, size))
+        {
+            p += inesHeaderSize;
+            size -= inesHeaderSize;
+        }
+
+        Hasher hash(wanted);
+        hash.add(p, size);
+        return hash.result();
+    }
+
+    RomFingerprint RomFingerprint::compute(QIODevice& in, const RomFingerprint& wanted, bool skipInesHeader)
+    {
+        Hasher hash(wanted);
+        QByteArray buf;
+        bool first = true;
+        while(true)
+        {
+            buf.resize(streamChunkSize);
+            auto got = in.read(buf.data(), buf.size());
+            if(got < 0)
+                return RomFingerprint();
+            if(got == 0)
+                break;
+
+            const char* p = buf.constData();
+            if(first && skipInesHeader && hasInesHeader(p, got))
+            {
+                p += inesHeaderSize;
+                got -= inesHeaderSize;
+            }
+            first = false;
+            hash.add(p, got);
+        }
+        return hash.result();
+    }
+
+    std::string RomFingerprint::mismatch(const RomFingerprint& actual) const
+    {
+        std::string out;
+        auto add = [&] (const std::string& what, const std::string& is, const std::string& expected)
+        {
+            out += (out.empty() ? "" : ", ") + what + " is " + is + " (expected " + expected + ")";
+        };
+
+        if(size >= 0 && actual.size != size)                                add("size", std::to_string(actual.size), std::to_string(size));
+        if(hasCrc32 && (!actual.hasCrc32 || actual.crc32 != crc32))         add("CRC32", hexCrc(actual.crc32), hexCrc(crc32));
+        if(!sha1.isEmpty() && actual.sha1 != sha1)                          add("SHA-1", actual.sha1.toStdString(), sha1.toStdString());
+        return out;
+    }
+}
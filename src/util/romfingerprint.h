@@ -0,0 +1,41 @@
+#ifndef LUSCH_UTIL_ROMFINGERPRINT_H_INCLUDED
+#define LUSCH_UTIL_ROMFINGERPRINT_H_INCLUDED
+
+#include <cstdint>
+#include <string>
+#include <QByteArray>
+
+class QIODevice;
+
+/*
+    What identifies a ROM:  its size, CRC32, and SHA-1 -- the same values ROM databases (No-Intro and
+    the like) list.  A blueprint can give any of these for a file (see Blueprint::loadFileInfoFromJson),
+    and the file is checked against them before it's imported from.
+
+    NES ROMs usually have a 16 byte iNES header in front of them, which varies between dumps of the same
+    game.  With 'skipInesHeader', a file starting with one is fingerprinted without it, which is how
+    the databases list them.
+
+    compute() only works out what 'wanted' has.  When it needs both, the CRC32 is done on a worker
+    thread while the SHA-1 is done on this one.  Files too big to hold in memory can be fingerprinted
+    straight from the device, a piece at a time.
+ */
+
+namespace lsh
+{
+    struct RomFingerprint
+    {
+        qint64          size = -1;              // -1 if not known
+        bool            hasCrc32 = false;
+        std::uint32_t   crc32 = 0;
+        QByteArray      sha1;                   // lowercase hex.  Empty if not known
+
+        bool            empty() const           { return size < 0 && !hasCrc32 && sha1.isEmpty();  }
+
+        static RomFingerprint   compute(const QByteArray& data, const RomFingerprint& wanted, bool skipInesHeader);
+        static RomFingerprint   compute(QIODevice& in, const RomFingerprint& wanted, bool skipInesHeader);   // reads to the end.  size is -1 on a read error
+        std::string             mismatch(const RomFingerprint& actual) const;  // what in 'actual' is different from this.  Empty if nothing
+    };
+}
+
+#endif
@@ -0,0 +1,506 @@
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "rompatch.h"
+#include "crc32.h"
+#include "error.h"
+
+namespace lsh
+{
+    namespace
+    {
+        const char              ipsHeader[5] = { 'P', 'A', 'T', 'C', 'H' };
+        const char              ipsFooter[3] = { 'E', 'O', 'F' };
+        const std::size_t       ipsMaxFileSize = 0x1000000;     // offsets are 3 bytes
+        const std::size_t       ipsEofOffset = 0x454F46;        // a record here would look like the footer
+        const std::size_t       ipsMaxRecord = 0xFFFF;
+        const std::size_t       ipsMergeGap = 5;                // unchanged bytes it's cheaper to rewrite than to start a new record over
+        const std::size_t       ipsMinRun = 9;                  // repeated bytes worth a run record, rather than being in a normal one
+
+        const char              bpsHeader[4] = { 'B', 'P', 'S', '1' };
+        const std::size_t       bpsFooterSize = 12;
+        const std::size_t       bpsMinMatch = 4;                // shorter than this, it's cheaper to just put the bytes in the patch
+        enum BpsAction
+        {
+            SourceRead = 0,
+            TargetRead,
+            SourceCopy,
+            TargetCopy
+        };
+
+        typedef const unsigned char     byte;
+
+        //////////////////////////////////////////
+        //  Reading and writing numbers
+
+        void putBE(QByteArray& out, std::size_t v, int bytes)
+        {
+            for(int i = bytes - 1; i >= 0; --i)
+                out.append( static_cast<char>( (v >> (i*8)) & 0xFF ) );
+        }
+
+        std::size_t getBE(const QByteArray& in, std::size_t& pos, int bytes)
+        {
+            if(pos + bytes > static_cast<std::size_t>(in.size()))
+                throw Error("IPS patch is incomplete or damaged");
+
+            std::size_t v = 0;
+            for(int i = 0; i < bytes; ++i)
+                v = (v << 8) | static_cast<byte>(in[static_cast<int>(pos++)]);
+            return v;
+        }
+
+        void putLE32(QByteArray& out, std::uint32_t v)
+        {
+            for(int i = 0; i < 4; ++i)
+                out.append( static_cast<char>( (v >> (i*8)) & 0xFF ) );
+        }
+
+        std::uint32_t getLE32(byte* p)
+        {
+            return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<std::uint32_t>(p[3]) << 24);
+        }
+
+        //  BPS numbers:  7 bits a byte, low bits first, with the top bit set on the last byte
+        void putVarint(QByteArray& out, std::uint64_t v)
+        {
+            while(true)
+            {
+                auto x = static_cast<char>(v & 0x7F);
+                v >>= 7;
+                if(!v)
+                {
+                    out.append( static_cast<char>(x | 0x80) );
+                    return;
+                }
+                out.append(x);
+                --v;
+            }
+        }
+
+        std::uint64_t getVarint(byte*& p, byte* end)
+        {
+            std::uint64_t v = 0, shift = 1;
+            while(true)
+            {
+                if(p >= end || shift > (std::uint64_t(1) << 56))
+                    throw Error("BPS patch is damaged");
+                auto x = *p++;
+                v += (x & 0x7F) * shift;
+                if(x & 0x80)
+                    return v;
+                shift <<= 7;
+                v += shift;
+            }
+        }
+
+        //  Copy offsets are relative to where the last copy left off, and can go backwards
+        void putOffset(QByteArray& out, std::int64_t v)
+        {
+            putVarint( out, (static_cast<std::uint64_t>(v < 0 ? -v : v) << 1) | (v < 0 ? 1 : 0) );
+        }
+
+        std::int64_t getOffset(byte*& p, byte* end)
+        {
+            auto v = getVarint(p, end);
+            auto mag = static_cast<std::int64_t>(v >> 1);
+            return (v & 1) ? -mag : mag;
+        }
+
+        //////////////////////////////////////////
+        //  Finding matches
+
+        std::size_t matchLength(byte* a, byte* b, std::size_t max)
+        {
+            std::size_t n = 0;
+            while(n < max && a[n] == b[n])
+                ++n;
+            return n;
+        }
+
+        //  Positions (+ 1, so 0 is empty) of 4 byte windows, by their hash.  Later positions replace
+        //    earlier ones.
+        class WindowTable
+        {
+        public:
+            explicit WindowTable(std::size_t datasize)
+            {
+                shift = 32 - 10;
+                while(shift > 32 - 22 && (std::size_t(1) << (32 - shift)) < datasize)
+                    --shift;
+                table.resize( std::size_t(1) << (32 - shift), 0 );
+            }
+
+            void            insert(byte* data, std::size_t pos)     { table[slot(data + pos)] = static_cast<std::uint32_t>(pos + 1);     }
+            bool            find(byte* window, std::size_t& pos) const
+            {
+                auto v = table[slot(window)];
+                pos = v - 1;
+                return v != 0;
+            }
+
+        private:
+            std::size_t     slot(byte* p) const
+            {
+                std::uint32_t v;
+                std::memcpy(&v, p, 4);
+                return (v * 2654435761u) >> shift;
+            }
+
+            std::vector<std::uint32_t>  table;
+            int                         shift;
+        };
+    }
+
+    QByteArray RomPatch::create(Format format, const QByteArray& source, const QByteArray& target)
+    {
+        if(format == Format::Ips)   return createIps(source, target);
+        else                        return createBps(source, target);
+    }
+
+    QByteArray RomPatch::apply(const QByteArray& source, const QByteArray& patch)
+    {
+        if(patch.size() >= static_cast<int>(sizeof(ipsHeader)) && !std::memcmp(patch.constData(), ipsHeader, sizeof(ipsHeader)))
+            return applyIps(source, patch);
+        if(patch.size() >= static_cast<int>(sizeof(bpsHeader)) && !std::memcmp(patch.constData(), bpsHeader, sizeof(bpsHeader)))
+            return applyBps(source, patch);
+
+        throw Error("File is not an IPS or BPS patch");
+    }
+
+    RomPatch::Format RomPatch::formatForFile(const QString& path)
+    {
+        return path.toLower().endsWith(".ips") ? Format::Ips : Format::Bps;
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //  IPS
+
+    QByteArray RomPatch::createIps(const QByteArray& source, const QByteArray& target)
+    {
+        const std::size_t ssize = source.size();
+        const std::size_t tsize = target.size();
+        auto t = reinterpret_cast<byte*>(target.constData());
+        auto s = reinterpret_cast<byte*>(source.constData());
+
+        if(tsize > ipsMaxFileSize)
+            throw Error("IPS patches can't hold files larger than 16MB.  Use a BPS patch instead");
+
+        QByteArray out(ipsHeader, sizeof(ipsHeader));
+
+        auto differs = [&] (std::size_t i) { return i >= ssize || s[i] != t[i]; };
+
+        auto putRecord = [&] (std::size_t pos, std::size_t len)
+        {
+            if(pos == ipsEofOffset)         { --pos; ++len;     }       // rewriting the byte before is harmless
+            putBE(out, pos, 3);
+            putBE(out, len, 2);
+            out.append( reinterpret_cast<const char*>(t + pos), static_cast<int>(len) );
+        };
+        auto putRun = [&] (std::size_t pos, std::size_t len)
+        {
+            if(pos == ipsEofOffset)
+            {
+                putRecord(pos, 1);
+                if(!--len)      return;
+                ++pos;
+            }
+            putBE(out, pos, 3);
+            putBE(out, 0, 2);
+            putBE(out, len, 2);
+            out.append( static_cast<char>(t[pos]) );
+        };
+        auto runAt = [&] (std::size_t pos, std::size_t end, std::size_t max)
+        {
+            std::size_t n = 1;
+            while(pos + n < end && n < max && t[pos + n] == t[pos])
+                ++n;
+            return n;
+        };
+
+        for(std::size_t i = 0; i < tsize; )
+        {
+            if(!differs(i))
+            {
+                ++i;
+                continue;
+            }
+
+            //  Find the end of this change, taking in any small gaps of unchanged bytes
+            auto end = i + 1;
+            while(true)
+            {
+                while(end < tsize && differs(end))
+                    ++end;
+                auto next = end;
+                while(next < tsize && next - end <= ipsMergeGap && !differs(next))
+                    ++next;
+                if(next < tsize && next - end <= ipsMergeGap && differs(next))
+                    end = next;
+                else
+                    break;
+            }
+
+            //  Then split it into records.  Runs get their own.
+            while(i < end)
+            {
+                auto run = runAt(i, end, ipsMaxRecord);
+                if(run >= ipsMinRun)
+                {
+                    putRun(i, run);
+                    i += run;
+                    continue;
+                }
+
+                auto stop = i;
+                while(stop < end && stop - i < ipsMaxRecord - 1 && runAt(stop, end, ipsMinRun) < ipsMinRun)
+                    ++stop;
+                putRecord(i, stop - i);
+                i = stop;
+            }
+        }
+
+        out.append(ipsFooter, sizeof(ipsFooter));
+        if(tsize < ssize)
+            putBE(out, tsize, 3);           // the size to truncate to
+        return out;
+    }
+
+    QByteArray RomPatch::applyIps(const QByteArray& source, const QByteArray& patch)
+    {
+        QByteArray out = source;
+        std::size_t pos = sizeof(ipsHeader);
+
+        auto reserve = [&] (std::size_t size)
+        {
+            if(size > static_cast<std::size_t>(out.size()))
+                out.append( QByteArray(static_cast<int>(size - out.size()), '\0') );
+        };
+
+        while(true)
+        {
+            if(pos + 3 <= static_cast<std::size_t>(patch.size()) && !std::memcmp(patch.constData() + pos, ipsFooter, sizeof(ipsFooter)))
+            {
+                pos += 3;
+                break;
+            }
+
+            auto offset = getBE(patch, pos, 3);
+            auto len = getBE(patch, pos, 2);
+            if(len)
+            {
+                if(pos + len > static_cast<std::size_t>(patch.size()))
+                    throw Error("IPS patch is incomplete or damaged");
+                reserve(offset + len);
+                std::memcpy( out.data() + offset, patch.constData() + pos, len );
+                pos += len;
+            }
+            else
+            {
+                len = getBE(patch, pos, 2);
+                auto fill = static_cast<char>( getBE(patch, pos, 1) );
+                reserve(offset + len);
+                std::memset( out.data() + offset, fill, len );
+            }
+        }
+
+        //  Optionally, the size to truncate to
+        auto extra = patch.size() - pos;
+        if(extra == 3)
+        {
+            auto size = getBE(patch, pos, 3);
+            if(size < static_cast<std::size_t>(out.size()))
+                out.truncate( static_cast<int>(size) );
+        }
+        else if(extra)
+            throw Error("IPS patch has unexpected data after its end");
+
+        return out;
+    }
+
+    //////////////////////////////////////////////////////////////////
+    //  BPS
+
+    QByteArray RomPatch::createBps(const QByteArray& source, const QByteArray& target)
+    {
+        const std::size_t ssize = source.size();
+        const std::size_t tsize = target.size();
+        auto t = reinterpret_cast<byte*>(target.constData());
+        auto s = reinterpret_cast<byte*>(source.constData());
+
+        QByteArray out(bpsHeader, sizeof(bpsHeader));
+        putVarint(out, ssize);
+        putVarint(out, tsize);
+        putVarint(out, 0);              // no metadata
+
+        WindowTable srcTable(ssize), tgtTable(tsize);
+        for(std::size_t i = 0; i + 4 <= ssize; ++i)
+            srcTable.insert(s, i);
+
+        std::size_t     pos = 0;
+        std::size_t     literal = 0;        // start of bytes that'll have to go in the patch, up to 'pos'
+        std::size_t     tgtHashed = 0;      // target windows before this are in tgtTable
+        std::int64_t    srcRel = 0;         // where the last SourceCopy and TargetCopy left off
+        std::int64_t    tgtRel = 0;
+
+        while(pos < tsize)
+        {
+            //  Find the longest thing to copy here.  Ties go to the cheapest action.
+            std::size_t     best = 0;
+            std::size_t     from = 0;
+            BpsAction       action = TargetRead;
+
+            if(pos < ssize)
+            {
+                best = matchLength(s + pos, t + pos, std::min(ssize, tsize) - pos);
+                action = SourceRead;
+            }
+            if(pos + 4 <= tsize)
+            {
+                std::size_t c, n;
+                if(srcTable.find(t + pos, c) && (n = matchLength(s + c, t + pos, std::min(ssize - c, tsize - pos))) > best)
+                {
+                    best = n;   from = c;   action = SourceCopy;
+                }
+
+                for(; tgtHashed < pos && tgtHashed + 4 <= tsize; ++tgtHashed)
+                    tgtTable.insert(t, tgtHashed);
+                if(tgtTable.find(t + pos, c) && (n = matchLength(t + c, t + pos, tsize - pos)) > best)
+                {
+                    best = n;   from = c;   action = TargetCopy;
+                }
+            }
+            if(pos > 0 && t[pos - 1] == t[pos])
+            {
+                //  A run -- copying from the previous byte repeats it
+                auto n = matchLength(t + pos - 1, t + pos, tsize - pos);
+                if(n > best)
+                {
+                    best = n;   from = pos - 1;     action = TargetCopy;
+                }
+            }
+
+            if(best < bpsMinMatch)
+            {
+                ++pos;
+                continue;
+            }
+
+            if(pos > literal)
+            {
+                putVarint(out, ((pos - literal - 1) << 2) | TargetRead);
+                out.append( reinterpret_cast<const char*>(t + literal), static_cast<int>(pos - literal) );
+            }
+
+            putVarint(out, ((best - 1) << 2) | action);
+            if(action == SourceCopy)
+            {
+                putOffset(out, static_cast<std::int64_t>(from) - srcRel);
+                srcRel = from + best;
+            }
+            else if(action == TargetCopy)
+            {
+                putOffset(out, static_cast<std::int64_t>(from) - tgtRel);
+                tgtRel = from + best;
+            }
+
+            pos += best;
+            literal = pos;
+        }
+
+        if(pos > literal)
+        {
+            putVarint(out, ((pos - literal - 1) << 2) | TargetRead);
+            out.append( reinterpret_cast<const char*>(t + literal), static_cast<int>(pos - literal) );
+        }
+
+        putLE32(out, crc32(source.constData(), ssize));
+        putLE32(out, crc32(target.constData(), tsize));
+        putLE32(out, crc32(out.constData(), out.size()));
+        return out;
+    }
+
+    QByteArray RomPatch::applyBps(const QByteArray& source, const QByteArray& patch)
+    {
+        if(patch.size() < static_cast<int>(sizeof(bpsHeader) + bpsFooterSize))
+            throw Error("BPS patch is incomplete");
+
+        auto p =    reinterpret_cast<byte*>(patch.constData());
+        auto end =  p + patch.size() - bpsFooterSize;
+        if(crc32(patch.constData(), patch.size() - 4) != getLE32(end + 8))
+            throw Error("BPS patch is damaged (its checksum doesn't match)");
+
+        p += sizeof(bpsHeader);
+        auto ssize =    getVarint(p, end);
+        auto tsize =    getVarint(p, end);
+        auto metasize = getVarint(p, end);
+        if(metasize > static_cast<std::uint64_t>(end - p))
+            throw Error("BPS patch is damaged");
+        p += metasize;
+
+        if(ssize != static_cast<std::uint64_t>(source.size()))
+            throw Error("BPS patch is for a file of " + std::to_string(ssize) + " bytes, but the source file is " + std::to_string(source.size()) + " bytes");
+        if(crc32(source.constData(), source.size()) != getLE32(end))
+            throw Error("BPS patch is not for this source file (its checksum doesn't match)");
+        if(tsize > 0x7FFFFFFF)
+            throw Error("BPS patch makes a file too large to load");
+
+        auto s = reinterpret_cast<byte*>(source.constData());
+        QByteArray out(static_cast<int>(tsize), '\0');
+        auto t = reinterpret_cast<unsigned char*>(out.data());
+
+        std::uint64_t   pos = 0;
+        std::int64_t    srcRel = 0;
+        std::int64_t    tgtRel = 0;
+        while(p < end)
+        {
+            auto v = getVarint(p, end);
+            auto len = (v >> 2) + 1;
+            if(len > tsize - pos)
+                throw Error("BPS patch is damaged (it writes past the end of the file)");
+
+            switch(v & 3)
+            {
+            case SourceRead:
+                if(pos + len > ssize)
+                    throw Error("BPS patch is damaged (it reads past the end of the source)");
+                std::memcpy(t + pos, s + pos, len);
+                break;
+
+            case TargetRead:
+                if(len > static_cast<std::uint64_t>(end - p))
+                    throw Error("BPS patch is damaged");
+                std::memcpy(t + pos, p, len);
+                p += len;
+                break;
+
+            case SourceCopy:
+                srcRel += getOffset(p, end);
+                if(srcRel < 0 || static_cast<std::uint64_t>(srcRel) + len > ssize)
+                    throw Error("BPS patch is damaged (it reads past the end of the source)");
+                std::memcpy(t + pos, s + srcRel, len);
+                srcRel += len;
+                break;
+
+            case TargetCopy:
+                //  Can overlap what's being written (that's how runs work), so one byte at a time
+                tgtRel += getOffset(p, end);
+                if(tgtRel < 0 || static_cast<std::uint64_t>(tgtRel) >= pos)
+                    throw Error("BPS patch is damaged (it copies from part of the file not written yet)");
+                for(std::uint64_t i = 0; i < len; ++i)
+                    t[pos + i] = t[tgtRel + i];
+                tgtRel += len;
+                break;
+            }
+            pos += len;
+        }
+
+        if(pos != tsize)
+            throw Error("BPS patch is incomplete");
+        if(crc32(out.constData(), out.size()) != getLE32(end + 4))
+            throw Error("BPS patch did not produce the file it was made from (its checksum doesn't match)");
+        return out;
+    }
+}
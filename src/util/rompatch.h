@@ -0,0 +1,54 @@
+#ifndef LUSCH_UTIL_ROMPATCH_H_INCLUDED
+#define LUSCH_UTIL_ROMPATCH_H_INCLUDED
+
+#include <QByteArray>
+#include <QString>
+
+/*
+    Making and applying IPS and BPS patches.
+
+    IPS is the old format everything can apply:  a list of (offset, bytes) records, where a record can
+    also be a run of one repeated byte.  Offsets are 3 bytes, so it can't patch anything past 16MB, and
+    there's no checksum -- applying it to the wrong file just makes a mess.
+
+    BPS describes the target as a series of actions:  read bytes from the source at the same position
+    (SourceRead), take bytes from the patch (TargetRead), or copy from anywhere in the source or from
+    what's already been written of the target (SourceCopy / TargetCopy).  A TargetCopy from the byte
+    just written is how runs are stored.  It has CRC32s of the source, target, and patch, so applying
+    it to the wrong source is an error.
+
+    create() finds the copies by hashing every 4 byte window of the source and target into tables of
+    positions -- one pass over each, so making a patch for a 1MB ROM takes a few milliseconds.
+
+    Everything here throws lsh::Error for patches that are damaged or don't fit the source.
+ */
+
+namespace lsh
+{
+    class RomPatch
+    {
+    public:
+        enum class Format
+        {
+            Ips,
+            Bps
+        };
+
+        static QByteArray   create(Format format, const QByteArray& source, const QByteArray& target);
+        static QByteArray   apply(const QByteArray& source, const QByteArray& patch);     // format is told by the patch's header
+
+        static Format       formatForFile(const QString& path);     // by extension:  .ips is IPS, anything else is BPS
+
+    private:
+        static QByteArray   createIps(const QByteArray& source, const QByteArray& target);
+        static QByteArray   createBps(const QByteArray& source, const QByteArray& target);
+        static QByteArray   applyIps(const QByteArray& source, const QByteArray& patch);
+        static QByteArray   applyBps(const QByteArray& source, const QByteArray& patch);
+
+        RomPatch() = delete;
+        ~RomPatch() = delete;
+        RomPatch(const RomPatch&) = delete;
+    };
+}
+
+#endif